@@ -0,0 +1,188 @@
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+#include <algorithm>
+
+#include "capture.h"
+#include "log.h"
+
+// How much the file grows by each time the mapping fills up
+#define CAPTURE_GROW_SIZE (64 << 20)
+
+static const char CAPTURE_MAGIC[8] = {'S', 'W', 'A', 'D', 'G', 'C', 'A', 'P'};
+static const uint32_t CAPTURE_VERSION = 1;
+
+CaptureLog::CaptureLog()
+        : _fd(-1),
+          _map(nullptr),
+          _mapped(0),
+          _used(0),
+          _records(0) {}
+
+CaptureLog::~CaptureLog() {
+    close();
+}
+
+bool CaptureLog::open(const std::string &path) {
+    close();
+
+    _fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (_fd < 0) {
+        return false;
+    }
+
+    if (!grow(sizeof(CaptureHeader))) {
+        close();
+        return false;
+    }
+
+    CaptureHeader header{};
+    memcpy(header.magic, CAPTURE_MAGIC, sizeof(header.magic));
+    header.version = CAPTURE_VERSION;
+
+    memcpy(_map, &header, sizeof(header));
+    _used = sizeof(header);
+    _records = 0;
+
+    return true;
+}
+
+bool CaptureLog::grow(size_t need) {
+    size_t size = _mapped;
+    while (size < _used + need) {
+        size += CAPTURE_GROW_SIZE;
+    }
+
+    if (ftruncate(_fd, (off_t)size) < 0) {
+        return false;
+    }
+
+    void *map = _map == nullptr
+                ? mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, _fd, 0)
+                : mremap(_map, _mapped, size, MREMAP_MAYMOVE);
+    if (map == MAP_FAILED) {
+        return false;
+    }
+
+    _map = static_cast<char*>(map);
+    _mapped = size;
+    return true;
+}
+
+void CaptureLog::append(const struct sockaddr_in &address, const char *data, size_t len) {
+    if (_map == nullptr) {
+        return;
+    }
+
+    CaptureRecord record{};
+    record.len = (uint16_t)std::min<size_t>(len, UINT16_MAX);
+    record.ip = address.sin_addr.s_addr;
+    record.port = address.sin_port;
+
+    // Keep 8 bytes of zeroes after every record, so a reader always finds the end marker
+    if (_used + record.size() + sizeof(uint64_t) > _mapped && !grow(record.size() + sizeof(uint64_t))) {
+        logger().message(LogLevel::ERROR, "Capture file can't grow, stopped after %llu packets", _records);
+        close();
+        return;
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    record.time_ns = (uint64_t)now.tv_sec * 1000000000ull + (uint64_t)now.tv_nsec;
+
+    memcpy(_map + _used, &record, sizeof(record));
+    memcpy(_map + _used + sizeof(record), data, record.len);
+
+    _used += record.size();
+    _records++;
+}
+
+void CaptureLog::close() {
+    if (_map != nullptr) {
+        munmap(_map, _mapped);
+        _map = nullptr;
+    }
+
+    if (_fd >= 0) {
+        if (ftruncate(_fd, (off_t)_used) < 0) {
+            logger().message(LogLevel::WARN, "Capture file not trimmed, it ends with zeroes");
+        }
+
+        ::close(_fd);
+        _fd = -1;
+    }
+
+    _mapped = 0;
+    _used = 0;
+}
+
+CaptureReader::CaptureReader()
+        : _fd(-1),
+          _map(nullptr),
+          _size(0),
+          _offset(0) {}
+
+CaptureReader::CaptureReader(CaptureReader &&other)
+        : _fd(other._fd),
+          _map(other._map),
+          _size(other._size),
+          _offset(other._offset) {
+    other._fd = -1;
+    other._map = nullptr;
+}
+
+CaptureReader::~CaptureReader() {
+    if (_map != nullptr) {
+        munmap(const_cast<char*>(_map), _size);
+    }
+
+    if (_fd >= 0) {
+        close(_fd);
+    }
+}
+
+bool CaptureReader::open(const std::string &path) {
+    _fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (_fd < 0) {
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(_fd, &st) < 0 || (size_t)st.st_size < sizeof(CaptureHeader)) {
+        return false;
+    }
+
+    void *map = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, _fd, 0);
+    if (map == MAP_FAILED) {
+        return false;
+    }
+
+    _map = static_cast<const char*>(map);
+    _size = (size_t)st.st_size;
+    madvise(map, _size, MADV_SEQUENTIAL);
+
+    CaptureHeader header;
+    memcpy(&header, _map, sizeof(header));
+    if (memcmp(header.magic, CAPTURE_MAGIC, sizeof(header.magic)) != 0 || header.version != CAPTURE_VERSION) {
+        return false;
+    }
+
+    _offset = sizeof(header);
+    return true;
+}
+
+const CaptureRecord *CaptureReader::peek() const {
+    if (_map == nullptr || _offset + sizeof(CaptureRecord) > _size) {
+        return nullptr;
+    }
+
+    const CaptureRecord *record = reinterpret_cast<const CaptureRecord*>(_map + _offset);
+    if (record->time_ns == 0 || _offset + sizeof(CaptureRecord) + record->len > _size) {
+        return nullptr;
+    }
+
+    return record;
+}
@@ -0,0 +1,124 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <netinet/in.h>
+#include <string>
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * The start of every capture file
+ */
+struct CaptureHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+};
+
+/**
+ * One received datagram in a capture file. The datagram follows straight after, padded so the next record
+ * starts on an 8 byte boundary. A record with a time of 0 marks the end.
+ */
+struct CaptureRecord {
+    // CLOCK_REALTIME nanoseconds, so captures from different workers can be merged
+    uint64_t time_ns;
+
+    // Where it came from, both in network order
+    uint32_t ip;
+    uint16_t port;
+
+    uint16_t len;
+
+    const char *data() const {
+        return reinterpret_cast<const char*>(this + 1);
+    }
+
+    size_t size() const {
+        return (sizeof(CaptureRecord) + len + 7) & ~(size_t)7;
+    }
+};
+
+static_assert(sizeof(CaptureHeader) == 16, "CaptureHeader is part of the file format");
+static_assert(sizeof(CaptureRecord) == 16, "CaptureRecord is part of the file format");
+
+/**
+ * Appends received datagrams to a memory-mapped file. Belongs to one worker, so there is no locking; an
+ * append is a copy into the mapping, and the file only grows, a large step at a time, when that runs out.
+ *
+ * The mapping is shared, so everything appended is in the page cache even if the router dies before
+ * close(), and the zeroes past the last record read as the end.
+ */
+class CaptureLog {
+    int _fd;
+    char *_map;
+    size_t _mapped;
+    size_t _used;
+    uint64_t _records;
+
+    bool grow(size_t need);
+
+public:
+    CaptureLog();
+    ~CaptureLog();
+
+    CaptureLog(const CaptureLog&) = delete;
+    CaptureLog &operator=(const CaptureLog&) = delete;
+
+    /**
+     * @param path truncated if it exists
+     * @return false if the file can't be created or mapped
+     */
+    bool open(const std::string &path);
+
+    bool is_open() const { return _map != nullptr; }
+
+    /**
+     * Records a datagram, stamped with the time now. If the file can't grow, capture stops.
+     * @param address
+     * @param data
+     * @param len
+     */
+    void append(const struct sockaddr_in &address, const char *data, size_t len);
+
+    /**
+     * Trims the file to what was written and unmaps it
+     */
+    void close();
+
+    uint64_t records() const { return _records; }
+};
+
+/**
+ * Reads a capture file back, record by record, straight out of a read-only mapping
+ */
+class CaptureReader {
+    int _fd;
+    const char *_map;
+    size_t _size;
+    size_t _offset;
+
+public:
+    CaptureReader();
+    ~CaptureReader();
+
+    CaptureReader(CaptureReader &&other);
+    CaptureReader(const CaptureReader&) = delete;
+    CaptureReader &operator=(const CaptureReader&) = delete;
+
+    /**
+     * @param path
+     * @return false if the file can't be mapped or isn't a capture
+     */
+    bool open(const std::string &path);
+
+    /**
+     * @return the next record without moving past it, or nullptr at the end
+     */
+    const CaptureRecord *peek() const;
+
+    void next() {
+        _offset += peek()->size();
+    }
+};
+
+#endif
@@ -0,0 +1,261 @@
+#ifndef CODEC_H
+#define CODEC_H
+
+#include <netinet/in.h>
+#include <stddef.h>
+#include <string.h>
+#include <algorithm>
+#include <string>
+#include <cstdint>
+
+#include "packets.h"
+
+/**
+ * Where a packet type travels. Badges send INBOUND packets to the router and the router sends OUTBOUND
+ * packets to badges; anything else is a type we don't know.
+ */
+enum class Direction : uint8_t {
+    NONE,
+    INBOUND,
+    OUTBOUND,
+};
+
+// The largest datagram the router will build, which fits in a default SendQueue slot
+static const size_t MAX_PACKET_SIZE = 256;
+
+inline void set_mac_address(uint8_t *data, uint64_t mac) {
+    data[0] = (uint8_t)((mac >> 40) & 0xff);
+    data[1] = (uint8_t)((mac >> 32) & 0xff);
+    data[2] = (uint8_t)((mac >> 24) & 0xff);
+    data[3] = (uint8_t)((mac >> 16) & 0xff);
+    data[4] = (uint8_t)((mac >> 8) & 0xff);
+    data[5] = (uint8_t)(mac & 0xff);
+}
+
+/**
+ * Describes one PACKET_TYPE: its wire struct, the smallest valid length and which way it travels.
+ * Inbound types name the View that reads them in place; outbound types say how long the packet for a set
+ * of arguments is and how to fill it in. Types with no specialization are unknown.
+ */
+template<uint8_t type>
+struct PacketTraits {
+    static constexpr Direction direction = Direction::NONE;
+};
+
+// Outbound packets with no variable part are always their struct's size
+template<typename T>
+struct FixedPacket {
+    typedef T Packet;
+    static constexpr Direction direction = Direction::OUTBOUND;
+    static constexpr size_t min_length = sizeof(T);
+
+    template<typename... Args>
+    static size_t length(const Args&...) { return sizeof(T); }
+};
+
+template<>
+struct PacketTraits<STATUS> {
+    typedef StatusPacket Packet;
+    typedef StatusView View;
+    static constexpr Direction direction = Direction::INBOUND;
+    static constexpr size_t min_length = sizeof(StatusPacket);
+};
+
+template<>
+struct PacketTraits<SCAN> {
+    typedef ScanPacket Packet;
+    typedef ScanView View;
+    static constexpr Direction direction = Direction::INBOUND;
+    static constexpr size_t min_length = sizeof(ScanPacket);
+};
+
+template<>
+struct PacketTraits<LIGHTS> : FixedPacket<LightsPacket> {
+    static void encode(LightsPacket &packet, const LightData (&lights)[4], uint8_t mask, uint8_t match) {
+        packet.mask = mask;
+        packet.match = match;
+        memcpy(packet.lights, lights, sizeof(packet.lights));
+    }
+};
+
+template<>
+struct PacketTraits<LIGHTS_RSSI> : FixedPacket<LightsRssiPacket> {
+    static void encode(LightsRssiPacket &packet, uint8_t min_rssi, uint8_t max_rssi, uint8_t led_intensity) {
+        packet.min_rssi = min_rssi;
+        packet.max_rssi = max_rssi;
+        packet.led_intensity = led_intensity;
+    }
+};
+
+template<>
+struct PacketTraits<SCAN_REQUEST> : FixedPacket<ScanRequestPacket> {
+    static void encode(ScanRequestPacket &) {}
+};
+
+template<>
+struct PacketTraits<LIGHTS_RAINBOW> : FixedPacket<LightsRainbowPacket> {
+    static void encode(LightsRainbowPacket &packet, uint16_t runtime, uint8_t speed, uint8_t intensity,
+                       uint8_t offset) {
+        packet.runtime = htons(runtime);
+        packet.speed = speed;
+        packet.intensity = intensity;
+        packet.offset = offset;
+    }
+};
+
+template<>
+struct PacketTraits<CONFIG> : FixedPacket<ConfigurePacket> {
+    static void encode(ConfigurePacket &packet, uint8_t requested_update, uint8_t disable_push,
+                       uint8_t disable_raw, uint8_t raw_rate) {
+        packet.requested_update = requested_update;
+        packet.disable_push = disable_push;
+        packet.disable_raw = disable_raw;
+        packet.raw_rate = raw_rate;
+    }
+};
+
+template<>
+struct PacketTraits<DEEP_SLEEP> : FixedPacket<DeepSleepPacket> {
+    static void encode(DeepSleepPacket &) {}
+};
+
+template<>
+struct PacketTraits<STATUS_REQUEST> : FixedPacket<StatusRequestPacket> {
+    static void encode(StatusRequestPacket &) {}
+};
+
+template<>
+struct PacketTraits<TEXT> {
+    typedef TextPacket Packet;
+    static constexpr Direction direction = Direction::OUTBOUND;
+    static constexpr size_t min_length = sizeof(TextPacket);
+
+    // Text that doesn't fit in MAX_PACKET_SIZE is cut short; the terminator takes the place of TextPacket::text
+    static size_t length(uint8_t, uint8_t, uint8_t, const std::string &text) {
+        return std::min(sizeof(TextPacket) + text.size(), MAX_PACKET_SIZE);
+    }
+
+    static void encode(TextPacket &packet, uint8_t x, uint8_t y, uint8_t style, const std::string &text) {
+        size_t text_len = length(x, y, style, text) - sizeof(TextPacket);
+
+        packet.x = x;
+        packet.y = y;
+        packet.opts = style;
+
+        memcpy(&packet.text, text.data(), text_len);
+        (&packet.text)[text_len] = '\0';
+    }
+};
+
+// These go over the air as is, so any padding or a changed field would break every badge
+static_assert(sizeof(BasePacket) == 7, "BasePacket must be 7 bytes");
+static_assert(offsetof(BasePacket, type) == 6, "The packet type must follow the MAC");
+static_assert(PacketTraits<STATUS>::min_length == 31, "StatusPacket must be 31 bytes");
+static_assert(PacketTraits<SCAN>::min_length == 12, "ScanPacket must be 12 bytes");
+static_assert(sizeof(ScanData) == 8, "ScanData must be 8 bytes");
+static_assert(PacketTraits<LIGHTS>::min_length == 22, "LightsPacket must be 22 bytes");
+static_assert(PacketTraits<LIGHTS_RSSI>::min_length == 10, "LightsRssiPacket must be 10 bytes");
+static_assert(PacketTraits<SCAN_REQUEST>::min_length == 7, "ScanRequestPacket must be 7 bytes");
+static_assert(PacketTraits<LIGHTS_RAINBOW>::min_length == 15, "LightsRainbowPacket must be 15 bytes");
+static_assert(PacketTraits<CONFIG>::min_length == 11, "ConfigurePacket must be 11 bytes");
+static_assert(PacketTraits<DEEP_SLEEP>::min_length == 7, "DeepSleepPacket must be 7 bytes");
+static_assert(PacketTraits<STATUS_REQUEST>::min_length == 7, "StatusRequestPacket must be 7 bytes");
+static_assert(PacketTraits<TEXT>::min_length == 11, "TextPacket must be 11 bytes");
+static_assert(PacketTraits<TEXT>::min_length < MAX_PACKET_SIZE, "TextPacket must leave room for text");
+
+/**
+ * Writes a whole packet for a badge
+ * @param out at least PacketTraits<type>::length(args...) bytes
+ * @param mac
+ * @param args whatever PacketTraits<type>::encode takes after the packet
+ * @return the length of the packet
+ */
+template<uint8_t type, typename... Args>
+size_t encode_packet(char *out, uint64_t mac, const Args&... args) {
+    typedef PacketTraits<type> Traits;
+    static_assert(Traits::direction == Direction::OUTBOUND, "Only packets for badges can be encoded");
+    static_assert(Traits::min_length <= MAX_PACKET_SIZE, "Packet is bigger than MAX_PACKET_SIZE");
+
+    auto &packet = *reinterpret_cast<typename Traits::Packet*>(out);
+    memset(out, 0, Traits::min_length);
+
+    set_mac_address(packet.base.mac.mac, mac);
+    packet.base.type = type;
+    Traits::encode(packet, args...);
+
+    return Traits::length(args...);
+}
+
+template<size_t... I>
+struct index_sequence {};
+
+template<size_t N, size_t... I>
+struct make_index_sequence : make_index_sequence<N - 1, N - 1, I...> {};
+
+template<size_t... I>
+struct make_index_sequence<0, I...> {
+    typedef index_sequence<I...> type;
+};
+
+/**
+ * Routes received datagrams to a handler by their type byte, through a table with an entry for all 256
+ * types that is built at compile time from PacketTraits.
+ *
+ * For each inbound type the Handler must have on_packet(Context&, sockaddr_in&, const View&). Packets too
+ * short for their type go to on_malformed and packets of any other type go to on_unknown, both of which
+ * take (Context&, sockaddr_in&, const char*, size_t).
+ */
+template<typename Handler, typename Context>
+class PacketDispatch {
+    typedef void (*Entry)(Handler&, Context&, struct sockaddr_in&, const char*, size_t);
+
+    template<uint8_t type, bool inbound = PacketTraits<type>::direction == Direction::INBOUND>
+    struct Decoder {
+        static void decode(Handler &handler, Context &context, struct sockaddr_in &address,
+                           const char *data, size_t len) {
+            handler.on_unknown(context, address, data, len);
+        }
+    };
+
+    template<uint8_t type>
+    struct Decoder<type, true> {
+        static void decode(Handler &handler, Context &context, struct sockaddr_in &address,
+                           const char *data, size_t len) {
+            typedef typename PacketTraits<type>::View View;
+
+            if (!View::valid(data, len)) {
+                handler.on_malformed(context, address, data, len);
+                return;
+            }
+
+            handler.on_packet(context, address, View(data));
+        }
+    };
+
+    template<typename Types>
+    struct Table;
+
+    template<size_t... types>
+    struct Table<index_sequence<types...>> {
+        static constexpr Entry entries[sizeof...(types)] = {&Decoder<(uint8_t)types>::decode...};
+    };
+
+    typedef Table<make_index_sequence<256>::type> Types;
+
+public:
+    static void dispatch(Handler &handler, Context &context, struct sockaddr_in &address,
+                         const char *data, size_t len) {
+        if (len < sizeof(BasePacket)) {
+            return;
+        }
+
+        Types::entries[(uint8_t)data[offsetof(BasePacket, type)]](handler, context, address, data, len);
+    }
+};
+
+template<typename Handler, typename Context>
+template<size_t... types>
+constexpr typename PacketDispatch<Handler, Context>::Entry
+        PacketDispatch<Handler, Context>::Table<index_sequence<types...>>::entries[sizeof...(types)];
+
+#endif
@@ -0,0 +1,64 @@
+#ifndef COMMANDS_H
+#define COMMANDS_H
+
+#include <cstdint>
+
+#include "packets.h"
+#include "codec.h"
+
+enum class CommandKind : uint8_t {
+    LIGHTS,
+    TEXT,
+    SCAN,
+    KICK,
+    GAME_LIGHTS,
+    SCREEN,
+};
+
+/**
+ * A change to badge state asked for from outside the ingest workers. These are queued to the worker that
+ * owns the badge, so only that thread ever touches the badge or sends to it.
+ */
+struct Command {
+    // The longest text that fits in a TEXT packet
+    static const size_t MAX_TEXT = MAX_PACKET_SIZE - sizeof(TextPacket);
+
+    CommandKind kind;
+
+    // The badge, or 0 for commands about a whole game
+    uint64_t mac;
+
+    union {
+        struct {
+            LightData lights[4];
+            uint8_t mask;
+            uint8_t match;
+        } lights;
+
+        struct {
+            uint8_t x;
+            uint8_t y;
+            uint8_t style;
+            uint8_t len;
+            char text[MAX_TEXT];
+        } text;
+
+        struct {
+            uint16_t game_id;
+            LightData lights[4];
+            uint8_t mask;
+            uint8_t match;
+        } game_lights;
+
+        // Each line packed as x, y, style, length and then the text
+        struct {
+            uint8_t count;
+            uint8_t size;
+            char lines[MAX_TEXT];
+        } screen;
+    };
+};
+
+static_assert(Command::MAX_TEXT <= 0xff, "Command text length must fit in a byte");
+
+#endif
@@ -0,0 +1,594 @@
+#include <unistd.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <algorithm>
+
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#endif
+#endif
+
+// Multishot recvmsg needs the 6.0 uapi headers
+#if defined(IORING_RECV_MULTISHOT) && defined(__NR_io_uring_setup)
+#define HAVE_IO_URING 1
+#endif
+
+#include "event_loop.h"
+#include "log.h"
+
+static int open_timer(std::chrono::milliseconds interval) {
+    int timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (timerfd < 0) {
+        return -1;
+    }
+
+    long ms = std::max<long>(1, (long)interval.count());
+
+    struct itimerspec spec{};
+    spec.it_interval.tv_sec = ms / 1000;
+    spec.it_interval.tv_nsec = (ms % 1000) * 1000000;
+    spec.it_value = spec.it_interval;
+
+    if (timerfd_settime(timerfd, 0, &spec, nullptr) < 0) {
+        close(timerfd);
+        return -1;
+    }
+
+    return timerfd;
+}
+
+// Resets an eventfd or timerfd so it only reports again once there's something new
+static void drain(int fd) {
+    uint64_t count;
+    ssize_t res = read(fd, &count, sizeof(count));
+    (void)res;
+}
+
+/**
+ * Waits with epoll and drains the socket with recvmmsg. While batches keep coming back full there's more
+ * already waiting, so it doesn't block until one comes back short.
+ */
+class EpollLoop : public EventLoop {
+    int _epfd;
+    int _sockfd;
+    int _wakefd;
+    int _timerfd;
+
+    RecvBatch _batch;
+    bool _full;
+
+public:
+    EpollLoop(int sockfd, int wakefd, size_t batch_size, size_t buf_size)
+            : _epfd(-1),
+              _sockfd(sockfd),
+              _wakefd(wakefd),
+              _timerfd(-1),
+              _batch(batch_size, buf_size),
+              _full(false) {}
+
+    ~EpollLoop() override {
+        if (_timerfd >= 0) {
+            close(_timerfd);
+        }
+
+        if (_epfd >= 0) {
+            close(_epfd);
+        }
+    }
+
+    bool open(std::chrono::milliseconds interval) {
+        _epfd = epoll_create1(EPOLL_CLOEXEC);
+        _timerfd = open_timer(interval);
+        if (_epfd < 0 || _timerfd < 0) {
+            return false;
+        }
+
+        for (int fd : {_sockfd, _wakefd, _timerfd}) {
+            struct epoll_event event{};
+            event.events = EPOLLIN;
+            event.data.fd = fd;
+
+            if (epoll_ctl(_epfd, EPOLL_CTL_ADD, fd, &event) < 0) {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    uint32_t wait(Handler &handler) override {
+        struct epoll_event ready[3];
+        uint32_t events = 0;
+        bool readable = _full;
+
+        int count = epoll_wait(_epfd, ready, 3, _full ? 0 : -1);
+        if (count < 0 && errno != EINTR) {
+            logger().message(LogLevel::ERROR, "epoll_wait failed (errno %llu)", (uint64_t)errno);
+        }
+
+        for (int i = 0; i < count; i++) {
+            if (ready[i].data.fd == _sockfd) {
+                readable = true;
+            } else if (ready[i].data.fd == _wakefd) {
+                drain(_wakefd);
+                events |= WAKE;
+            } else if (ready[i].data.fd == _timerfd) {
+                drain(_timerfd);
+                events |= TIMER;
+            }
+        }
+
+        if (!readable) {
+            return events;
+        }
+
+        int received = recvmmsg(_sockfd, _batch.msgs(), _batch.size(), MSG_DONTWAIT, nullptr);
+        if (received < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                logger().message(LogLevel::ERROR, "recvmmsg failed (errno %llu)", (uint64_t)errno);
+            }
+
+            _full = false;
+            return events;
+        }
+
+        for (int i = 0; i < received; i++) {
+            handler.on_datagram(_batch.address(i), _batch.data(i), (size_t)_batch.length(i));
+        }
+
+        _batch.reset();
+        _full = (unsigned int)received == _batch.size();
+
+        return events;
+    }
+
+    const char *name() const override { return "epoll"; }
+};
+
+#ifdef HAVE_IO_URING
+
+/**
+ * Receives with one multishot recvmsg into a pool of provided buffers the kernel picks from, and watches
+ * the eventfd and the timer with multishot polls, so a wait is a single io_uring_enter. Buffers go back to
+ * the kernel once their datagrams have been handled, as one IORING_OP_PROVIDE_BUFFERS per run of
+ * consecutive ids, submitted ahead of anything that might need them.
+ *
+ * Registered buffer rings would save those submissions, but on some kernels recvs from them fail with
+ * ENOBUFS however many buffers are in the ring, and provided buffers work everywhere multishot does.
+ */
+class UringLoop : public EventLoop {
+    enum Tag : uint64_t {
+        RECV = 1,
+        WAKE_POLL,
+        TIMER_POLL,
+        PROVIDE,
+    };
+
+    static const unsigned SQ_ENTRIES = 64;
+    static const uint16_t BUFFER_GROUP = 0;
+
+    int _ringfd;
+    int _sockfd;
+    int _wakefd;
+    int _timerfd;
+
+    void *_sq_ring;
+    size_t _sq_ring_size;
+    void *_cq_ring;
+    size_t _cq_ring_size;
+    struct io_uring_sqe *_sqes;
+    size_t _sqes_size;
+
+    unsigned *_sq_head;
+    unsigned *_sq_tail;
+    unsigned _sq_mask;
+    unsigned *_sq_array;
+    // Entries are filled in up to here, and only handed to the kernel by submit()
+    unsigned _sq_next;
+
+    unsigned *_cq_head;
+    unsigned *_cq_tail;
+    unsigned _cq_mask;
+    struct io_uring_cqe *_cqes;
+
+    // Where received datagrams land, and the ids of those that are ready to go back to the kernel
+    unsigned _buf_count;
+    size_t _buf_size;
+    std::vector<char> _buffers;
+    std::vector<uint16_t> _returned;
+
+    // Only says how much room the source address gets in each buffer
+    struct msghdr _msghdr;
+
+    bool _recv_armed;
+    bool _wake_armed;
+    bool _timer_armed;
+
+    struct io_uring_sqe *next_sqe() {
+        // When the queue is full, hand what's there to the kernel to make room
+        if (_sq_next - __atomic_load_n(_sq_head, __ATOMIC_ACQUIRE) > _sq_mask && submit(0) < 0) {
+            return nullptr;
+        }
+
+        if (_sq_next - __atomic_load_n(_sq_head, __ATOMIC_ACQUIRE) > _sq_mask) {
+            return nullptr;
+        }
+
+        unsigned index = _sq_next++ & _sq_mask;
+        _sq_array[index] = index;
+
+        struct io_uring_sqe *sqe = &_sqes[index];
+        memset(sqe, 0, sizeof(*sqe));
+
+        return sqe;
+    }
+
+    /**
+     * Publishes the filled in entries and enters the kernel
+     * @param min_complete how many completions to wait for
+     * @return what io_uring_enter returned
+     */
+    long submit(unsigned min_complete) {
+        __atomic_store_n(_sq_tail, _sq_next, __ATOMIC_RELEASE);
+        unsigned pending = _sq_next - __atomic_load_n(_sq_head, __ATOMIC_ACQUIRE);
+
+        return syscall(__NR_io_uring_enter, _ringfd, pending, min_complete,
+                       min_complete > 0 ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+    }
+
+    bool arm_recv() {
+        struct io_uring_sqe *sqe = next_sqe();
+        if (sqe == nullptr) {
+            return false;
+        }
+
+        sqe->opcode = IORING_OP_RECVMSG;
+        sqe->fd = _sockfd;
+        sqe->addr = (uint64_t)(uintptr_t)&_msghdr;
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = BUFFER_GROUP;
+        sqe->user_data = RECV;
+
+        return true;
+    }
+
+    bool arm_poll(int fd, Tag tag) {
+        struct io_uring_sqe *sqe = next_sqe();
+        if (sqe == nullptr) {
+            return false;
+        }
+
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = fd;
+        sqe->poll32_events = POLLIN;
+        sqe->len = IORING_POLL_ADD_MULTI;
+        sqe->user_data = tag;
+
+        return true;
+    }
+
+    bool provide(uint16_t first, unsigned count) {
+        struct io_uring_sqe *sqe = next_sqe();
+        if (sqe == nullptr) {
+            return false;
+        }
+
+        sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+        sqe->fd = (int)count;
+        sqe->addr = (uint64_t)(uintptr_t)&_buffers[first * _buf_size];
+        sqe->len = (uint32_t)_buf_size;
+        sqe->off = first;
+        sqe->buf_group = BUFFER_GROUP;
+        sqe->flags = IOSQE_CQE_SKIP_SUCCESS;
+        sqe->user_data = PROVIDE;
+
+        return true;
+    }
+
+    void return_buffers() {
+        if (_returned.empty()) {
+            return;
+        }
+
+        std::sort(_returned.begin(), _returned.end());
+
+        size_t start = 0;
+        for (size_t i = 1; i <= _returned.size(); i++) {
+            if (i == _returned.size() || _returned[i] != _returned[i - 1] + 1) {
+                if (!provide(_returned[start], (unsigned)(i - start))) {
+                    logger().message(LogLevel::ERROR, "io_uring: lost %llu receive buffers", i - start);
+                }
+                start = i;
+            }
+        }
+
+        _returned.clear();
+    }
+
+    void on_recv(Handler &handler, const struct io_uring_cqe &cqe) {
+        if (cqe.res < 0) {
+            // Running out of buffers just ends the multishot; it's rearmed once they're back
+            if (cqe.res != -ENOBUFS) {
+                logger().message(LogLevel::ERROR, "io_uring recvmsg failed (errno %llu)", (uint64_t)-cqe.res);
+            }
+            return;
+        }
+
+        if (!(cqe.flags & IORING_CQE_F_BUFFER)) {
+            return;
+        }
+
+        uint16_t id = (uint16_t)(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+        const char *buf = &_buffers[id * _buf_size];
+
+        struct io_uring_recvmsg_out out;
+        memcpy(&out, buf, sizeof(out));
+
+        size_t offset = sizeof(out) + _msghdr.msg_namelen + _msghdr.msg_controllen;
+        size_t len = std::min<size_t>(out.payloadlen, (size_t)cqe.res - std::min<size_t>(offset, (size_t)cqe.res));
+
+        struct sockaddr_in address{};
+        memcpy(&address, buf + sizeof(out), std::min<size_t>(out.namelen, sizeof(address)));
+
+        handler.on_datagram(address, buf + offset, len);
+        _returned.push_back(id);
+    }
+
+public:
+    UringLoop(int sockfd, int wakefd, size_t batch_size, size_t buf_size)
+            : _ringfd(-1),
+              _sockfd(sockfd),
+              _wakefd(wakefd),
+              _timerfd(-1),
+              _sq_ring(MAP_FAILED),
+              _sq_ring_size(0),
+              _cq_ring(MAP_FAILED),
+              _cq_ring_size(0),
+              _sqes((struct io_uring_sqe*)MAP_FAILED),
+              _sqes_size(0),
+              _sq_head(nullptr),
+              _sq_tail(nullptr),
+              _sq_mask(0),
+              _sq_array(nullptr),
+              _sq_next(0),
+              _cq_head(nullptr),
+              _cq_tail(nullptr),
+              _cq_mask(0),
+              _cqes(nullptr),
+              // Room for a few batches in flight, so the kernel rarely runs dry while we handle one
+              _buf_count((unsigned)std::min<size_t>(std::max<size_t>(batch_size * 4, 64), 32768)),
+              _buf_size(sizeof(struct io_uring_recvmsg_out) + sizeof(struct sockaddr_in) + buf_size),
+              _buffers(),
+              _returned(),
+              _msghdr(),
+              _recv_armed(false),
+              _wake_armed(false),
+              _timer_armed(false) {
+        _msghdr.msg_namelen = sizeof(struct sockaddr_in);
+    }
+
+    ~UringLoop() override {
+        if (_ringfd >= 0) {
+            close(_ringfd);
+        }
+
+        if (_sqes != MAP_FAILED) {
+            munmap(_sqes, _sqes_size);
+        }
+
+        if (_cq_ring != MAP_FAILED && _cq_ring != _sq_ring) {
+            munmap(_cq_ring, _cq_ring_size);
+        }
+
+        if (_sq_ring != MAP_FAILED) {
+            munmap(_sq_ring, _sq_ring_size);
+        }
+
+        if (_timerfd >= 0) {
+            close(_timerfd);
+        }
+    }
+
+    bool open(std::chrono::milliseconds interval) {
+        struct io_uring_params params{};
+        params.flags = IORING_SETUP_CQSIZE;
+        // Every buffer can be holding a completion at once, plus the polls
+        params.cq_entries = _buf_count * 2;
+
+        _ringfd = (int)syscall(__NR_io_uring_setup, SQ_ENTRIES, &params);
+        if (_ringfd < 0) {
+            return false;
+        }
+
+        _sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        _cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+
+        bool single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+        if (single_mmap) {
+            _sq_ring_size = _cq_ring_size = std::max(_sq_ring_size, _cq_ring_size);
+        }
+
+        _sq_ring = mmap(nullptr, _sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        _ringfd, IORING_OFF_SQ_RING);
+        if (_sq_ring == MAP_FAILED) {
+            return false;
+        }
+
+        _cq_ring = single_mmap ? _sq_ring : mmap(nullptr, _cq_ring_size, PROT_READ | PROT_WRITE,
+                                                 MAP_SHARED | MAP_POPULATE, _ringfd, IORING_OFF_CQ_RING);
+        if (_cq_ring == MAP_FAILED) {
+            return false;
+        }
+
+        _sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+        _sqes = (struct io_uring_sqe*)mmap(nullptr, _sqes_size, PROT_READ | PROT_WRITE,
+                                           MAP_SHARED | MAP_POPULATE, _ringfd, IORING_OFF_SQES);
+        if (_sqes == MAP_FAILED) {
+            return false;
+        }
+
+        char *sq = (char*)_sq_ring;
+        _sq_head = (unsigned*)(sq + params.sq_off.head);
+        _sq_tail = (unsigned*)(sq + params.sq_off.tail);
+        _sq_mask = *(unsigned*)(sq + params.sq_off.ring_mask);
+        _sq_array = (unsigned*)(sq + params.sq_off.array);
+        _sq_next = *_sq_tail;
+
+        char *cq = (char*)_cq_ring;
+        _cq_head = (unsigned*)(cq + params.cq_off.head);
+        _cq_tail = (unsigned*)(cq + params.cq_off.tail);
+        _cq_mask = *(unsigned*)(cq + params.cq_off.ring_mask);
+        _cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+
+        _buffers.resize(_buf_count * _buf_size);
+        _returned.reserve(_buf_count);
+
+        _timerfd = open_timer(interval);
+        if (_timerfd < 0) {
+            return false;
+        }
+
+        // Make sure multishot receive actually works here before committing to it
+        provide(0, _buf_count);
+        _recv_armed = arm_recv();
+        _wake_armed = arm_poll(_wakefd, WAKE_POLL);
+        _timer_armed = arm_poll(_timerfd, TIMER_POLL);
+
+        // Anything the kernel doesn't support fails while it's being submitted
+        if (submit(0) < 0) {
+            return false;
+        }
+
+        unsigned head = *_cq_head;
+        unsigned tail = __atomic_load_n(_cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            const struct io_uring_cqe &cqe = _cqes[head & _cq_mask];
+            if (cqe.res == -EINVAL || cqe.res == -EOPNOTSUPP) {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    uint32_t wait(Handler &handler) override {
+        // Buffers from the last wait go first, in case the recv stopped for want of them
+        return_buffers();
+
+        if (!_recv_armed) {
+            _recv_armed = arm_recv();
+        }
+
+        if (!_wake_armed) {
+            _wake_armed = arm_poll(_wakefd, WAKE_POLL);
+        }
+
+        if (!_timer_armed) {
+            _timer_armed = arm_poll(_timerfd, TIMER_POLL);
+        }
+
+        unsigned head = *_cq_head;
+
+        // Only block when nothing has completed already
+        unsigned min_complete = head == __atomic_load_n(_cq_tail, __ATOMIC_ACQUIRE) ? 1 : 0;
+        if (_sq_next != *_sq_tail || min_complete > 0) {
+            if (submit(min_complete) < 0 && errno != EINTR) {
+                logger().message(LogLevel::ERROR, "io_uring_enter failed (errno %llu)", (uint64_t)errno);
+            }
+        }
+
+        uint32_t events = 0;
+        unsigned tail = __atomic_load_n(_cq_tail, __ATOMIC_ACQUIRE);
+
+        for (; head != tail; head++) {
+            const struct io_uring_cqe &cqe = _cqes[head & _cq_mask];
+            bool more = (cqe.flags & IORING_CQE_F_MORE) != 0;
+
+            switch (cqe.user_data) {
+                case RECV:
+                    _recv_armed = _recv_armed && more;
+                    on_recv(handler, cqe);
+                    break;
+
+                case WAKE_POLL:
+                    _wake_armed = _wake_armed && more;
+                    drain(_wakefd);
+                    events |= WAKE;
+                    break;
+
+                case TIMER_POLL:
+                    _timer_armed = _timer_armed && more;
+                    drain(_timerfd);
+                    events |= TIMER;
+                    break;
+
+                case PROVIDE:
+                    logger().message(LogLevel::ERROR, "io_uring: returning buffers failed (errno %llu)", (uint64_t)-cqe.res);
+                    break;
+
+                default:
+                    break;
+            }
+        }
+
+        __atomic_store_n(_cq_head, head, __ATOMIC_RELEASE);
+
+        return events;
+    }
+
+    const char *name() const override { return "io_uring"; }
+};
+
+#endif
+
+std::unique_ptr<EventLoop> EventLoop::create(Backend backend, int sockfd, int wakefd,
+                                             std::chrono::milliseconds interval,
+                                             size_t batch_size, size_t buf_size) {
+#ifdef HAVE_IO_URING
+    if (backend != Backend::EPOLL) {
+        UringLoop *uring = new UringLoop(sockfd, wakefd, batch_size, buf_size);
+        std::unique_ptr<EventLoop> loop(uring);
+        if (uring->open(interval)) {
+            return loop;
+        }
+
+        if (backend == Backend::IO_URING) {
+            return nullptr;
+        }
+    }
+#else
+    if (backend == Backend::IO_URING) {
+        return nullptr;
+    }
+#endif
+
+    EpollLoop *epoll = new EpollLoop(sockfd, wakefd, batch_size, buf_size);
+    std::unique_ptr<EventLoop> loop(epoll);
+    if (!epoll->open(interval)) {
+        return nullptr;
+    }
+
+    return loop;
+}
+
+bool parse_event_loop_backend(const std::string &name, EventLoop::Backend &backend) {
+    if (strcasecmp(name.c_str(), "auto") == 0) {
+        backend = EventLoop::Backend::AUTO;
+    } else if (strcasecmp(name.c_str(), "epoll") == 0) {
+        backend = EventLoop::Backend::EPOLL;
+    } else if (strcasecmp(name.c_str(), "io_uring") == 0 || strcasecmp(name.c_str(), "uring") == 0) {
+        backend = EventLoop::Backend::IO_URING;
+    } else {
+        return false;
+    }
+
+    return true;
+}
@@ -0,0 +1,120 @@
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+#include <cstdint>
+
+/**
+ * Preallocated buffers for draining several datagrams with a single recvmmsg call
+ */
+class RecvBatch {
+    size_t _buf_size;
+    std::vector<char> _data;
+    std::vector<struct mmsghdr> _msgs;
+    std::vector<struct iovec> _iovecs;
+    std::vector<struct sockaddr_in> _addrs;
+
+public:
+    RecvBatch(size_t size, size_t buf_size)
+            : _buf_size(buf_size),
+              _data(size * buf_size),
+              _msgs(size),
+              _iovecs(size),
+              _addrs(size) {
+        for (size_t i = 0; i < size; i++) {
+            _iovecs[i].iov_base = &_data[i * buf_size];
+            _iovecs[i].iov_len = buf_size;
+
+            _msgs[i].msg_hdr = {};
+            _msgs[i].msg_hdr.msg_iov = &_iovecs[i];
+            _msgs[i].msg_hdr.msg_iovlen = 1;
+            _msgs[i].msg_hdr.msg_name = &_addrs[i];
+        }
+
+        reset();
+    }
+
+    /**
+     * Restores the lengths the kernel overwrote during the last receive
+     */
+    void reset() {
+        for (auto &msg : _msgs) {
+            msg.msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+            msg.msg_len = 0;
+        }
+    }
+
+    struct mmsghdr *msgs() { return _msgs.data(); }
+    unsigned int size() const { return (unsigned int)_msgs.size(); }
+
+    const char *data(size_t i) const { return &_data[i * _buf_size]; }
+    ssize_t length(size_t i) const { return _msgs[i].msg_len; }
+    struct sockaddr_in &address(size_t i) { return _addrs[i]; }
+};
+
+
+/**
+ * Waits on everything an ingest worker reacts to: datagrams on its socket, an eventfd other threads
+ * write to when they want it, and a periodic timer. Datagrams are handed over as they are received;
+ * the rest is reported as flags for the worker to act on.
+ *
+ * A loop belongs to one thread. It doesn't own the socket or the eventfd, only its own timer.
+ */
+class EventLoop {
+public:
+    enum class Backend : uint8_t {
+        // io_uring if the kernel allows it, otherwise epoll
+        AUTO,
+        EPOLL,
+        IO_URING,
+    };
+
+    // What, apart from datagrams, happened during a wait
+    enum Events : uint32_t {
+        WAKE = 1,
+        TIMER = 2,
+    };
+
+    class Handler {
+    public:
+        virtual ~Handler() = default;
+
+        /**
+         * Called for every datagram. The data is only valid until this returns.
+         */
+        virtual void on_datagram(struct sockaddr_in &address, const char *data, size_t len) = 0;
+    };
+
+    /**
+     * @param backend
+     * @param sockfd the socket to receive from
+     * @param wakefd an eventfd, drained whenever it is reported
+     * @param interval how often TIMER is reported
+     * @param batch_size how many datagrams to take from the kernel at once
+     * @param buf_size the largest datagram; longer ones are cut short
+     * @return the loop, or nullptr if the backend can't be used
+     */
+    static std::unique_ptr<EventLoop> create(Backend backend, int sockfd, int wakefd,
+                                             std::chrono::milliseconds interval,
+                                             size_t batch_size, size_t buf_size);
+
+    virtual ~EventLoop() = default;
+
+    /**
+     * Blocks until something happens, and delivers every datagram that has arrived to the handler
+     * @param handler
+     * @return the Events that happened besides, or 0 if it was only datagrams
+     */
+    virtual uint32_t wait(Handler &handler) = 0;
+
+    virtual const char *name() const = 0;
+};
+
+bool parse_event_loop_backend(const std::string &name, EventLoop::Backend &backend);
+
+#endif
@@ -0,0 +1,136 @@
+#include <algorithm>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "fingerprints.h"
+
+#define LANES 4
+#define MAX_NEIGHBOURS 16
+
+// Far enough that padding rows never win, but still finite so the arithmetic can't make NaNs
+static const float UNREACHABLE = 1e30f;
+
+constexpr float FingerprintDb::FLOOR;
+
+FingerprintDb::FingerprintDb()
+        : _samples(),
+          _columns(),
+          _rows(0),
+          _matrix(),
+          _base(),
+          _labels() {}
+
+FingerprintDb::FingerprintDb(std::vector<Fingerprint> samples)
+        : _samples(std::move(samples)),
+          _columns(),
+          _rows((_samples.size() + LANES - 1) / LANES * LANES),
+          _matrix(),
+          _base(_rows, UNREACHABLE),
+          _labels(_rows, 0) {
+    for (const auto &sample : _samples) {
+        for (const auto &station : sample.stations) {
+            _columns.emplace(station.first, _columns.size());
+        }
+    }
+
+    _matrix.assign(_columns.size() * _rows, FLOOR);
+
+    for (size_t row = 0; row < _samples.size(); row++) {
+        const Fingerprint &sample = _samples[row];
+        float base = 0;
+
+        for (const auto &station : sample.stations) {
+            float &cell = _matrix[_columns[station.first] * _rows + row];
+
+            // A BSSID listed twice keeps its strongest reading, the same as in a Scan
+            cell = std::max(cell, (float)station.second);
+        }
+
+        for (const auto &column : _columns) {
+            float diff = _matrix[column.second * _rows + row] - FLOOR;
+            base += diff * diff;
+        }
+
+        _base[row] = base;
+        _labels[row] = sample.location;
+    }
+}
+
+/*
+ * Moves every fingerprint's distance from "heard nothing" at this access point to "heard it at rssi":
+ * (c - rssi)^2 - (c - FLOOR)^2 = (FLOOR - rssi) * (2c - rssi - FLOOR) = c * 2a + b
+ */
+static void accumulate(float *distances, const float *column, size_t rows, float rssi) {
+    float a = FingerprintDb::FLOOR - rssi;
+    float b = -a * (rssi + FingerprintDb::FLOOR);
+    size_t row = 0;
+
+#ifdef __SSE2__
+    const __m128 a2 = _mm_set1_ps(2 * a);
+    const __m128 bv = _mm_set1_ps(b);
+
+    for (; row + LANES <= rows; row += LANES) {
+        __m128 c = _mm_loadu_ps(column + row);
+        __m128 d = _mm_loadu_ps(distances + row);
+        _mm_storeu_ps(distances + row, _mm_add_ps(d, _mm_add_ps(_mm_mul_ps(c, a2), bv)));
+    }
+#endif
+
+    for (; row < rows; row++) {
+        distances[row] += column[row] * 2 * a + b;
+    }
+}
+
+uint16_t FingerprintDb::classify(const Scan &scan, size_t k) const {
+    if (_samples.empty()) {
+        return 0;
+    }
+
+    // Each worker classifies its own badges' scans, so give every thread its own scratch space
+    static thread_local std::vector<float> distances;
+    distances.assign(_base.begin(), _base.end());
+
+    for (const auto &station : scan.stations()) {
+        auto column = _columns.find((uint64_t)station.mac());
+        if (column != _columns.end()) {
+            accumulate(distances.data(), &_matrix[column->second * _rows], _rows, station.rssi());
+        }
+    }
+
+    // Keep the k nearest in order, nearest first
+    k = std::max<size_t>(1, std::min<size_t>(std::min<size_t>(k, MAX_NEIGHBOURS), _samples.size()));
+
+    size_t nearest[MAX_NEIGHBOURS];
+    size_t found = 0;
+
+    for (size_t row = 0; row < _samples.size(); row++) {
+        if (found == k && distances[row] >= distances[nearest[k - 1]]) {
+            continue;
+        }
+
+        size_t i = found < k ? found++ : k - 1;
+        for (; i > 0 && distances[nearest[i - 1]] > distances[row]; i--) {
+            nearest[i] = nearest[i - 1];
+        }
+        nearest[i] = row;
+    }
+
+    uint16_t best = _labels[nearest[0]];
+    size_t best_votes = 0;
+
+    for (size_t i = 0; i < found; i++) {
+        size_t votes = 0;
+        for (size_t j = 0; j < found; j++) {
+            votes += _labels[nearest[j]] == _labels[nearest[i]];
+        }
+
+        if (votes > best_votes) {
+            best = _labels[nearest[i]];
+            best_votes = votes;
+        }
+    }
+
+    return best;
+}
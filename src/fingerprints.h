@@ -0,0 +1,57 @@
+#ifndef FINGERPRINTS_H
+#define FINGERPRINTS_H
+
+#include <vector>
+#include <unordered_map>
+#include <utility>
+#include <cstdint>
+
+#include "packets.h"
+
+/**
+ * What a badge heard at a known location: the RSSI of each access point, by BSSID
+ */
+struct Fingerprint {
+    uint16_t location;
+    std::vector<std::pair<uint64_t, int8_t>> stations;
+};
+
+/**
+ * An immutable set of fingerprints, laid out for k-nearest-neighbour matching against scans.
+ *
+ * The matrix is column-major: each BSSID that appears in any fingerprint has one column holding its RSSI
+ * in every fingerprint, or FLOOR where it wasn't heard. Each fingerprint's distance to a scan of nothing
+ * at all is precomputed, so a scan only has to walk the columns of the stations it actually heard, and
+ * each of those walks is a straight vector pass down one column.
+ */
+class FingerprintDb {
+    std::vector<Fingerprint> _samples;
+
+    std::unordered_map<uint64_t, size_t> _columns;
+    // Fingerprints, rounded up so every column is a whole number of vectors
+    size_t _rows;
+    std::vector<float> _matrix;
+    std::vector<float> _base;
+    std::vector<uint16_t> _labels;
+
+public:
+    // The RSSI an access point is taken to have when it wasn't heard
+    static constexpr float FLOOR = -100.0f;
+
+    FingerprintDb();
+    explicit FingerprintDb(std::vector<Fingerprint> samples);
+
+    const std::vector<Fingerprint> &samples() const { return _samples; }
+    size_t size() const { return _samples.size(); }
+    bool empty() const { return _samples.empty(); }
+
+    /**
+     * Finds the k fingerprints closest to a scan, by euclidean distance over RSSI, and takes a vote
+     * @param scan
+     * @param k
+     * @return the location most of them are from, the nearest one's on a tie; 0 if there are no fingerprints
+     */
+    uint16_t classify(const Scan &scan, size_t k) const;
+};
+
+#endif
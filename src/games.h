@@ -0,0 +1,244 @@
+#ifndef GAMES_H
+#define GAMES_H
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <unordered_map>
+#include <mutex>
+#include <stdexcept>
+#include <cstdint>
+
+#include "join_matcher.h"
+
+class GameInfo {
+    uint16_t _id;
+    std::string _name;
+    std::string _sequence;
+    std::string _location;
+
+public:
+    GameInfo(uint16_t id, const std::string name, const std::string &sequence = "", const std::string &location = "")
+            : _id(id),
+              _name(std::move(name)),
+              _sequence(sequence),
+              _location(location) {}
+
+    /**
+     * What badges store to say they're in this game; never 0
+     */
+    uint16_t id() const {
+        return _id;
+    }
+
+    const std::string &name() const {
+        return _name;
+    }
+
+    bool use_sequence() const {
+        return !_sequence.empty();
+    }
+
+    bool use_location() const {
+        return !_location.empty();
+    }
+
+    const std::string &sequence() const {
+        return _sequence;
+    }
+
+    void set_sequence(const std::string sequence) {
+        _sequence = sequence;
+    }
+
+    const std::string &location() const {
+        return _location;
+    }
+
+    void set_location(const std::string location) {
+        _location = location;
+    }
+};
+
+/**
+ * Gives every location name a small number, so that badges and the game index compare locations by id.
+ * Interning happens when games or fingerprints are registered, never on the packet path.
+ */
+class LocationTable {
+    mutable std::mutex _mutex;
+    std::unordered_map<std::string, uint16_t> _ids;
+    std::deque<std::string> _names;
+
+public:
+    /**
+     * @param name
+     * @return the id for this location, allocating one if needed; 0 for no location
+     * @throws std::runtime_error if there are no ids left
+     */
+    uint16_t intern(const std::string &name) {
+        if (name.empty()) {
+            return 0;
+        }
+
+        std::lock_guard<std::mutex> lock(_mutex);
+
+        auto found = _ids.find(name);
+        if (found != _ids.end()) {
+            return found->second;
+        }
+
+        if (_names.size() >= 0xffff) {
+            throw std::runtime_error("Too many locations");
+        }
+
+        _names.push_back(name);
+        uint16_t id = (uint16_t)_names.size();
+        _ids.emplace(name, id);
+        return id;
+    }
+
+    /**
+     * @param name
+     * @return the id for this location, or 0 if it has never been interned
+     */
+    uint16_t find(const std::string &name) const {
+        std::lock_guard<std::mutex> lock(_mutex);
+
+        auto found = _ids.find(name);
+        return found != _ids.end() ? found->second : 0;
+    }
+
+    /**
+     * @param id
+     * @return the name of the location, empty for 0. Names never move once interned.
+     */
+    const std::string &name(uint16_t id) const {
+        static const std::string none;
+
+        std::lock_guard<std::mutex> lock(_mutex);
+        return id == 0 || id > _names.size() ? none : _names[id - 1];
+    }
+};
+
+/**
+ * An immutable snapshot of every registered game, the join automaton built from them, and indexes by
+ * name, sequence and location so that joins and registrations are a hash probe rather than a walk.
+ *
+ * Registering a game builds a new set and swaps it in, so ingest workers can keep reading the one they
+ * loaded without locks. Ids are positions in the list and stay the same from one set to the next.
+ */
+class GameSet {
+    std::vector<GameInfo> _games;
+    JoinMatcher _matcher;
+
+    std::unordered_map<std::string, uint16_t> _by_name;
+    std::unordered_map<std::string, uint16_t> _by_sequence;
+    std::unordered_map<uint16_t, uint16_t> _by_location;
+
+    const GameInfo *lookup(const std::unordered_map<std::string, uint16_t> &index, const std::string &key) const {
+        auto found = index.find(key);
+        return found != index.end() ? game(found->second) : nullptr;
+    }
+
+public:
+    GameSet()
+            : _games(),
+              _matcher(_games, 0) {}
+
+    GameSet(std::vector<GameInfo> games, uint16_t version, LocationTable &locations)
+            : _games(std::move(games)),
+              _matcher(_games, version) {
+        for (const auto &game : _games) {
+            _by_name.emplace(game.name(), game.id());
+
+            if (game.use_sequence()) {
+                _by_sequence.emplace(game.sequence(), game.id());
+            }
+
+            if (game.use_location()) {
+                _by_location.emplace(locations.intern(game.location()), game.id());
+            }
+        }
+    }
+
+    const std::vector<GameInfo> &games() const {
+        return _games;
+    }
+
+    const JoinMatcher &matcher() const {
+        return _matcher;
+    }
+
+    /**
+     * @param id
+     * @return the game with this id, or nullptr for 0
+     */
+    const GameInfo *game(uint16_t id) const {
+        if (id == 0 || id > _games.size()) {
+            return nullptr;
+        }
+
+        return &_games[id - 1];
+    }
+
+    /**
+     * @param name
+     * @return the game registered under this name, or nullptr
+     */
+    const GameInfo *find(const std::string &name) const {
+        return lookup(_by_name, name);
+    }
+
+    /**
+     * @param location an id from the LocationTable
+     * @return the game players join by being at this location, or nullptr
+     */
+    const GameInfo *at_location(uint16_t location) const {
+        if (location == 0) {
+            return nullptr;
+        }
+
+        auto found = _by_location.find(location);
+        return found != _by_location.end() ? game(found->second) : nullptr;
+    }
+
+    /**
+     * Builds the set that results from registering a game, or re-registering one with new join rules
+     * @param name
+     * @param sequence
+     * @param location
+     * @param locations where location names are interned
+     * @return
+     * @throws std::runtime_error if another game already uses the sequence or location
+     */
+    GameSet *with_game(const std::string &name, const std::string &sequence, const std::string &location,
+                       LocationTable &locations) const {
+        if (!sequence.empty()) {
+            const GameInfo *other = lookup(_by_sequence, sequence);
+            if (other != nullptr && other->name() != name) {
+                throw std::runtime_error("Sequence " + sequence + " already in use by " + other->name());
+            }
+        }
+
+        if (!location.empty()) {
+            const GameInfo *other = at_location(locations.find(location));
+            if (other != nullptr && other->name() != name) {
+                throw std::runtime_error("Location " + location + " already in use by " + other->name());
+            }
+        }
+
+        std::vector<GameInfo> games(_games);
+
+        const GameInfo *existing = find(name);
+        if (existing != nullptr) {
+            games[existing->id() - 1].set_sequence(sequence);
+            games[existing->id() - 1].set_location(location);
+        } else {
+            games.emplace_back((uint16_t)(games.size() + 1), name, sequence, location);
+        }
+
+        return new GameSet(std::move(games), (uint16_t)(_matcher.version() + 1), locations);
+    }
+};
+
+#endif
@@ -0,0 +1,79 @@
+#include <deque>
+
+#include "join_matcher.h"
+#include "games.h"
+#include "log.h"
+
+JoinMatcher::JoinMatcher(const std::vector<GameInfo> &games, uint16_t version)
+        : _version(version),
+          _next(1),
+          _match(1, 0) {
+    _next[0].fill(0);
+
+    // Build the trie of all the sequences
+    for (const auto &game : games) {
+        if (!game.use_sequence()) {
+            continue;
+        }
+
+        State state = start();
+        bool valid = true;
+
+        for (char c : game.sequence()) {
+            BUTTON b = button_from_char(c);
+            if (b == BUTTON::NONE || (_next[state][(size_t)b] == 0 && _next.size() >= MAX_STATES)) {
+                valid = false;
+                break;
+            }
+
+            if (_next[state][(size_t)b] == 0) {
+                _next[state][(size_t)b] = (State)_next.size();
+                _next.emplace_back();
+                _next.back().fill(0);
+                _match.push_back(0);
+            }
+
+            state = _next[state][(size_t)b];
+        }
+
+        if (!valid) {
+            logger().message(LogLevel::WARN, "Join sequence for game %llu can't be matched", game.id());
+            continue;
+        }
+
+        if (state != start() && (_match[state] == 0 || game.id() < _match[state])) {
+            _match[state] = game.id();
+        }
+    }
+
+    // Breadth first, point every missing transition at where the longest matching suffix would go, and
+    // let each state also report the sequences that end in a suffix of it
+    std::vector<State> fail(_next.size(), start());
+    std::deque<State> queue;
+
+    for (size_t b = 1; b < ALPHABET; b++) {
+        if (_next[start()][b] != 0) {
+            queue.push_back(_next[start()][b]);
+        }
+    }
+
+    while (!queue.empty()) {
+        State state = queue.front();
+        queue.pop_front();
+
+        uint16_t inherited = _match[fail[state]];
+        if (inherited != 0 && (_match[state] == 0 || inherited < _match[state])) {
+            _match[state] = inherited;
+        }
+
+        for (size_t b = 1; b < ALPHABET; b++) {
+            State child = _next[state][b];
+            if (child != 0) {
+                fail[child] = _next[fail[state]][b];
+                queue.push_back(child);
+            } else {
+                _next[state][b] = _next[fail[state]][b];
+            }
+        }
+    }
+}
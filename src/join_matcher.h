@@ -0,0 +1,58 @@
+#ifndef JOIN_MATCHER_H
+#define JOIN_MATCHER_H
+
+#include <array>
+#include <vector>
+#include <cstdint>
+
+#include "packets.h"
+
+class GameInfo;
+
+/**
+ * Every registered join sequence compiled into one automaton (Aho-Corasick over the button alphabet, with
+ * the failure links folded into the transition table).
+ *
+ * A badge only keeps its current state. Each button it releases is a single table lookup, and the state
+ * says which game, if any, has a sequence ending with the buttons pressed so far, however many games are
+ * registered. When several sequences end there, the game registered first wins.
+ */
+class JoinMatcher {
+public:
+    typedef uint16_t State;
+
+private:
+    static const size_t ALPHABET = (size_t)BUTTON::A + 1;
+    static const size_t MAX_STATES = 0xffff;
+
+    uint16_t _version;
+    std::vector<std::array<State, ALPHABET>> _next;
+    std::vector<uint16_t> _match;
+
+public:
+    /**
+     * @param games
+     * @param version tells badges whose state came from a different automaton to rebuild it
+     */
+    JoinMatcher(const std::vector<GameInfo> &games, uint16_t version);
+
+    uint16_t version() const { return _version; }
+
+    State start() const { return 0; }
+
+    State advance(State state, BUTTON b) const {
+        return _next[state][(size_t)b < ALPHABET ? (size_t)b : 0];
+    }
+
+    /**
+     * @param state
+     * @return the id of the game whose sequence was just completed, or 0
+     */
+    uint16_t match(State state) const {
+        return _match[state];
+    }
+
+    size_t states() const { return _next.size(); }
+};
+
+#endif
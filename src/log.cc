@@ -0,0 +1,235 @@
+#include <strings.h>
+#include <chrono>
+
+#include "log.h"
+
+// How often the logging thread reports records it had to drop
+#define DROP_REPORT_MS 5000
+
+static const char *LEVEL_NAMES[] {
+        "DEBUG",
+        "INFO",
+        "WARN",
+        "ERROR",
+};
+
+static uint64_t now_ms() {
+    using namespace std::chrono;
+    return (uint64_t)duration_cast<milliseconds>(system_clock::now().time_since_epoch()).count();
+}
+
+bool parse_log_level(const std::string &name, LogLevel &level) {
+    for (int i = 0; i < (int)LogLevel::NONE; i++) {
+        if (strcasecmp(name.c_str(), LEVEL_NAMES[i]) == 0) {
+            level = (LogLevel)i;
+            return true;
+        }
+    }
+
+    if (strcasecmp(name.c_str(), "none") == 0) {
+        level = LogLevel::NONE;
+        return true;
+    }
+
+    return false;
+}
+
+Logger::Logger(FILE *out, size_t capacity)
+        : _ring(capacity),
+          _level(LogLevel::INFO),
+          _dropped(0),
+          _running(true),
+          _out(out),
+          _thread() {
+    _thread = std::thread(&Logger::run, this);
+}
+
+Logger::~Logger() {
+    _running = false;
+    if (_thread.joinable()) {
+        _thread.join();
+    }
+}
+
+void Logger::push(LogRecord &record) {
+    record.time = now_ms();
+
+    if (!_ring.try_push(record)) {
+        _dropped.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+void Logger::message(LogLevel level, const char *format, uint64_t a, uint64_t b, uint64_t c) {
+    if (!enabled(level)) return;
+
+    LogRecord record;
+    record.level = level;
+    record.kind = LogKind::MESSAGE;
+    record.message.format = format;
+    record.message.args[0] = a;
+    record.message.args[1] = b;
+    record.message.args[2] = c;
+    push(record);
+}
+
+void Logger::status(LogLevel level, const StatusView &status) {
+    if (!enabled(level)) return;
+
+    LogRecord record;
+    record.level = level;
+    record.kind = LogKind::STATUS;
+    record.status.mac = status.mac();
+    record.status.update_count = status.update_count();
+    record.status.gpio_state = status.gpio_state();
+    record.status.last_button = status.last_button();
+    record.status.button_down = status.button_down();
+    push(record);
+}
+
+void Logger::scan(LogLevel level, const ScanView &scan) {
+    if (!enabled(level)) return;
+
+    LogRecord record;
+    record.level = level;
+    record.kind = LogKind::SCAN;
+    record.scan.mac = scan.mac();
+    record.scan.timestamp = scan.timestamp();
+    record.scan.stations = (uint16_t)scan.station_count();
+    push(record);
+}
+
+void Logger::text(LogLevel level, uint64_t mac, uint8_t x, uint8_t y, size_t len) {
+    if (!enabled(level)) return;
+
+    LogRecord record;
+    record.level = level;
+    record.kind = LogKind::TEXT;
+    record.text.mac = mac;
+    record.text.x = x;
+    record.text.y = y;
+    record.text.len = (uint16_t)len;
+    push(record);
+}
+
+void Logger::unknown_packet(LogLevel level, uint64_t mac, uint8_t type, size_t len) {
+    if (!enabled(level)) return;
+
+    LogRecord record;
+    record.level = level;
+    record.kind = LogKind::UNKNOWN_PACKET;
+    record.packet.mac = mac;
+    record.packet.type = type;
+    record.packet.len = (uint16_t)len;
+    push(record);
+}
+
+void Logger::malformed_packet(LogLevel level, uint64_t mac, uint8_t type, size_t len) {
+    if (!enabled(level)) return;
+
+    LogRecord record;
+    record.level = level;
+    record.kind = LogKind::MALFORMED_PACKET;
+    record.packet.mac = mac;
+    record.packet.type = type;
+    record.packet.len = (uint16_t)len;
+    push(record);
+}
+
+static std::string mac_string(uint64_t mac) {
+    uint8_t data[6];
+    for (int i = 0; i < 6; i++) {
+        data[i] = (uint8_t)((mac >> (40 - 8 * i)) & 0xff);
+    }
+
+    return std::string(MacAddress(data));
+}
+
+void Logger::write(const LogRecord &record) {
+    fprintf(_out, "%llu.%03llu %-5s ",
+            (unsigned long long)(record.time / 1000), (unsigned long long)(record.time % 1000),
+            LEVEL_NAMES[(int)record.level]);
+
+    switch (record.kind) {
+        case LogKind::MESSAGE:
+            fprintf(_out, record.message.format,
+                    (unsigned long long)record.message.args[0],
+                    (unsigned long long)record.message.args[1],
+                    (unsigned long long)record.message.args[2]);
+            break;
+
+        case LogKind::STATUS:
+            fprintf(_out, "< Status: [%s] #%u",
+                    mac_string(record.status.mac).c_str(), record.status.update_count);
+
+            if (record.status.last_button != BUTTON::NONE || record.status.gpio_state != 0) {
+                fprintf(_out, " %s %s",
+                        button_name(record.status.last_button).c_str(),
+                        record.status.button_down ? "PRESS" : "RELEASE");
+            }
+
+            fputs(" >", _out);
+            break;
+
+        case LogKind::SCAN:
+            fprintf(_out, "< Scan: [%s] %u stations @%u >",
+                    mac_string(record.scan.mac).c_str(), record.scan.stations, record.scan.timestamp);
+            break;
+
+        case LogKind::TEXT:
+            fprintf(_out, "Text for [%s] at %u,%u len %u",
+                    mac_string(record.text.mac).c_str(), record.text.x, record.text.y, record.text.len);
+            break;
+
+        case LogKind::UNKNOWN_PACKET:
+            fprintf(_out, "Got UNKNOWN packet type 0x%02x (%u bytes) from [%s]",
+                    record.packet.type, record.packet.len, mac_string(record.packet.mac).c_str());
+            break;
+
+        case LogKind::MALFORMED_PACKET:
+            fprintf(_out, "Dropped malformed packet type 0x%02x (%u bytes) from [%s]",
+                    record.packet.type, record.packet.len, mac_string(record.packet.mac).c_str());
+            break;
+    }
+
+    fputc('\n', _out);
+}
+
+void Logger::run() {
+    LogRecord record;
+    uint64_t reported = 0;
+    uint64_t last_report = now_ms();
+
+    for (;;) {
+        bool wrote = false;
+        while (_ring.try_pop(record)) {
+            write(record);
+            wrote = true;
+        }
+
+        uint64_t time = now_ms();
+        if (time - last_report >= DROP_REPORT_MS) {
+            uint64_t dropped = _dropped;
+            if (dropped != reported) {
+                fprintf(_out, "Logger dropped %llu records\n", (unsigned long long)(dropped - reported));
+                reported = dropped;
+                wrote = true;
+            }
+
+            last_report = time;
+        }
+
+        if (wrote) {
+            fflush(_out);
+        } else if (!_running) {
+            break;
+        } else {
+            // Nothing to do; producers never signal us, so just check back shortly
+            std::this_thread::sleep_for(std::chrono::milliseconds(2));
+        }
+    }
+}
+
+Logger &logger() {
+    static Logger instance;
+    return instance;
+}
@@ -0,0 +1,118 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <atomic>
+#include <thread>
+#include <cstdio>
+#include <cstdint>
+
+#include "packets.h"
+#include "ring.h"
+
+enum class LogLevel : uint8_t {
+    DEBUG = 0,
+    INFO = 1,
+    WARN = 2,
+    ERROR = 3,
+    NONE = 4,
+};
+
+bool parse_log_level(const std::string &name, LogLevel &level);
+
+enum class LogKind : uint8_t {
+    MESSAGE,
+    STATUS,
+    SCAN,
+    TEXT,
+    UNKNOWN_PACKET,
+    MALFORMED_PACKET,
+};
+
+/**
+ * A fixed-size log entry. The packet path only copies a few integers in here; turning it into text is
+ * left to the logging thread.
+ */
+struct LogRecord {
+    uint64_t time;
+    LogLevel level;
+    LogKind kind;
+
+    union {
+        struct {
+            // Must point at a string literal, it is read long after the call returns
+            const char *format;
+            uint64_t args[3];
+        } message;
+
+        struct {
+            uint64_t mac;
+            uint16_t update_count;
+            uint8_t gpio_state;
+            BUTTON last_button;
+            bool button_down;
+        } status;
+
+        struct {
+            uint64_t mac;
+            uint32_t timestamp;
+            uint16_t stations;
+        } scan;
+
+        struct {
+            uint64_t mac;
+            uint8_t x;
+            uint8_t y;
+            uint16_t len;
+        } text;
+
+        struct {
+            uint64_t mac;
+            uint8_t type;
+            uint16_t len;
+        } packet;
+    };
+};
+
+/**
+ * Asynchronous logger. Callers push binary records into a lock-free ring and a background thread formats
+ * and writes them out. When the ring is full the record is dropped and counted; logging never blocks.
+ */
+class Logger {
+    MpscRing<LogRecord> _ring;
+    std::atomic<LogLevel> _level;
+    std::atomic<uint64_t> _dropped;
+    std::atomic<bool> _running;
+    FILE *_out;
+    std::thread _thread;
+
+    void push(LogRecord &record);
+    void write(const LogRecord &record);
+    void run();
+
+public:
+    explicit Logger(FILE *out = stdout, size_t capacity = 8192);
+    ~Logger();
+
+    Logger(const Logger&) = delete;
+    Logger &operator=(const Logger&) = delete;
+
+    void set_level(LogLevel level) { _level = level; }
+    LogLevel level() const { return _level; }
+
+    bool enabled(LogLevel level) const {
+        return level >= _level.load(std::memory_order_relaxed);
+    }
+
+    uint64_t dropped() const { return _dropped; }
+
+    void message(LogLevel level, const char *format, uint64_t a = 0, uint64_t b = 0, uint64_t c = 0);
+    void status(LogLevel level, const StatusView &status);
+    void scan(LogLevel level, const ScanView &scan);
+    void text(LogLevel level, uint64_t mac, uint8_t x, uint8_t y, size_t len);
+    void unknown_packet(LogLevel level, uint64_t mac, uint8_t type, size_t len);
+    void malformed_packet(LogLevel level, uint64_t mac, uint8_t type, size_t len);
+};
+
+Logger &logger();
+
+#endif
@@ -1,14 +1,164 @@
+#include <getopt.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <unistd.h>
+#include <atomic>
+
 #include "server.h"
 #include "wamp.h"
+#include "log.h"
 
-int main() {
-    auto server = std::make_shared<Server>();
+static void usage(const char *name) {
+    std::cerr << "Usage: " << name << " [--batch-size N] [--workers N] [--log-level debug|info|warn|error|none] [--scan-window MS] [--status-tick MS] [--event-loop auto|epoll|io_uring] [--badge-timeout MS] [--lights-rate HZ] [--capture PATH] [--replay FILE]... [--replay-realtime]" << std::endl;
+}
 
-    std::thread server_thread(std::bind(&Server::run, server));
+int main(int argc, char **argv) {
+    // Only this thread takes the shutdown signals. They are blocked before anything starts a thread, the
+    // logger included, so that every thread inherits the mask and a signal can't end the process unseen
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, nullptr);
 
+    auto server = std::make_shared<Server>();
     Wamp wamp(server);
-    std::thread wamp_thread(std::bind(&Wamp::run, wamp));
+
+    static const struct option options[] = {
+            {"batch-size", required_argument, nullptr, 'b'},
+            {"workers",    required_argument, nullptr, 'w'},
+            {"log-level",  required_argument, nullptr, 'l'},
+            {"scan-window", required_argument, nullptr, 's'},
+            {"status-tick", required_argument, nullptr, 't'},
+            {"event-loop", required_argument, nullptr, 'e'},
+            {"badge-timeout", required_argument, nullptr, 'B'},
+            {"lights-rate", required_argument, nullptr, 'r'},
+            {"capture",    required_argument, nullptr, 'c'},
+            {"replay",     required_argument, nullptr, 'R'},
+            {"replay-realtime", no_argument,  nullptr, 'T'},
+            {"help",       no_argument,       nullptr, 'h'},
+            {nullptr,      0,                 nullptr, 0},
+    };
+
+    std::vector<std::string> replay;
+    bool replay_realtime = false;
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "b:w:l:s:t:e:B:r:c:R:Th", options, nullptr)) != -1) {
+        switch (opt) {
+            case 'b':
+                server->set_batch_size(strtoul(optarg, nullptr, 10));
+                break;
+
+            case 'w':
+                server->set_workers(strtoul(optarg, nullptr, 10));
+                break;
+
+            case 'l': {
+                LogLevel level;
+                if (!parse_log_level(optarg, level)) {
+                    usage(argv[0]);
+                    return 1;
+                }
+
+                logger().set_level(level);
+                break;
+            }
+
+            case 's':
+                wamp.set_scan_window(std::chrono::milliseconds(strtoul(optarg, nullptr, 10)));
+                break;
+
+            case 't':
+                server->set_status_tick(std::chrono::milliseconds(strtoul(optarg, nullptr, 10)));
+                break;
+
+            case 'e': {
+                EventLoop::Backend backend;
+                if (!parse_event_loop_backend(optarg, backend)) {
+                    usage(argv[0]);
+                    return 1;
+                }
+
+                server->set_event_loop(backend);
+                break;
+            }
+
+            case 'B':
+                server->set_badge_timeout(std::chrono::milliseconds(strtoul(optarg, nullptr, 10)));
+                break;
+
+            case 'r':
+                server->set_lights_rate(strtoul(optarg, nullptr, 10));
+                break;
+
+            case 'c':
+                server->set_capture(optarg);
+                break;
+
+            case 'R':
+                replay.emplace_back(optarg);
+                break;
+
+            case 'T':
+                replay_realtime = true;
+                break;
+
+            case 'h':
+                usage(argv[0]);
+                return 0;
+
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+
+    // Replaying runs the packet handlers on their own, with no network and no WAMP
+    if (!replay.empty()) {
+        std::thread([server, signals]() {
+            int signal;
+            sigwait(&signals, &signal);
+            server->stop();
+        }).detach();
+
+        auto start = std::chrono::steady_clock::now();
+        uint64_t packets = server->replay(replay, replay_realtime);
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        if (packets == 0) {
+            return 1;
+        }
+
+        std::cout << "Replayed " << packets << " packets in " << seconds << " s ("
+                  << (uint64_t)(packets / seconds) << " packets/s)" << std::endl;
+        return 0;
+    }
+
+    // Before the WAMP thread starts, as it can change which worker owns each badge
+    if (!server->open()) {
+        return 1;
+    }
+
+    // If the server stops on its own, it couldn't serve; wake this thread to shut the rest down
+    std::atomic<bool> failed(false);
+    std::thread server_thread([server, &failed]() {
+        if (!server->run()) {
+            failed = true;
+            kill(getpid(), SIGTERM);
+        }
+    });
+
+    std::thread wamp_thread(&Wamp::run, &wamp);
+
+    int signal;
+    sigwait(&signals, &signal);
+
+    server->stop();
+    wamp.stop();
 
     server_thread.join();
     wamp_thread.join();
-}
\ No newline at end of file
+
+    return failed ? 1 : 0;
+}
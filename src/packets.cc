@@ -1,3 +1,5 @@
+#include <stdlib.h>
+
 #include "packets.h"
 
 const char button_char(BUTTON b) {
@@ -16,6 +18,16 @@ const char button_char(BUTTON b) {
     return MAP[(int)b];
 }
 
+BUTTON button_from_char(char c) {
+    for (int b = (int)BUTTON::RIGHT; b <= (int)BUTTON::A; b++) {
+        if (button_char((BUTTON)b) == c) {
+            return (BUTTON)b;
+        }
+    }
+
+    return BUTTON::NONE;
+}
+
 const std::string &button_name(BUTTON button) {
     switch (button) {
         case BUTTON::NONE:
@@ -39,39 +51,60 @@ const std::string &button_name(BUTTON button) {
     }
 }
 
-const Status Status::decode_from_packet(const StatusPacket *packet) {
-    assert (packet->base.type == (uint8_t)PACKET_TYPE::STATUS);
+template<typename T>
+static bool assign(T &field, const T &value) {
+    if (field == value) {
+        return false;
+    }
+
+    field = value;
+    return true;
+}
+
+uint16_t Status::update(const StatusView &view) {
+    uint16_t changed = 0;
 
-    return Status(
-            MacAddress(packet->base.mac.mac),
-            packet->version,
-            (int8_t)packet->rssi - 128,
-            MacAddress(packet->bssid.mac),
-            packet->gpio_state,
-            packet->last_button,
-            packet->button_down,
-            ntohs(packet->system_voltage),
-            ntohs(packet->update_count),
-            ntohs(packet->heap_free),
-            packet->sleep_perf,
-            ntohl(packet->time)
-    );
+    if ((uint64_t)_mac != view.mac())                      { _mac = view.mac_address(); changed |= FIELD_MAC; }
+    if (assign(_version, view.version()))                  changed |= FIELD_VERSION;
+    if (assign(_rssi, view.rssi()))                        changed |= FIELD_RSSI;
+    if ((uint64_t)_bssid != (uint64_t)view.bssid())        { _bssid = view.bssid(); changed |= FIELD_BSSID; }
+    if (assign(_gpio_state, view.gpio_state()))            changed |= FIELD_GPIO_STATE;
+    if (assign(_last_button, view.last_button()))          changed |= FIELD_LAST_BUTTON;
+    if (assign(_button_down, view.button_down()))          changed |= FIELD_BUTTON_DOWN;
+    if (assign(_system_voltage, view.system_voltage()))    changed |= FIELD_SYSTEM_VOLTAGE;
+    if (assign(_update_count, view.update_count()))        changed |= FIELD_UPDATE_COUNT;
+    if (assign(_heap_free, view.heap_free()))              changed |= FIELD_HEAP_FREE;
+    if (assign(_sleep_performance, view.sleep_performance())) changed |= FIELD_SLEEP_PERF;
+    if (assign(_time, view.time()))                        changed |= FIELD_TIME;
+
+    return changed;
 }
 
+uint16_t Status::changes(const Status &since, const StatusThresholds &thresholds) const {
+    uint16_t changed = 0;
 
-const Scan Scan::decode_from_packet(const ScanPacket *packet) {
-    assert (packet->base.type == (uint8_t)PACKET_TYPE::SCAN);
+    if (_version != since._version)                                         changed |= FIELD_VERSION;
+    if (abs(_rssi - since._rssi) >= thresholds.rssi)                        changed |= FIELD_RSSI;
+    if ((uint64_t)_bssid != (uint64_t)since._bssid)                         changed |= FIELD_BSSID;
+    if (_gpio_state != since._gpio_state)                                   changed |= FIELD_GPIO_STATE;
+    if (abs(_system_voltage - since._system_voltage) >= thresholds.system_voltage) changed |= FIELD_SYSTEM_VOLTAGE;
+    if (abs(_heap_free - since._heap_free) >= thresholds.heap_free)         changed |= FIELD_HEAP_FREE;
+    if (_sleep_performance != since._sleep_performance)                     changed |= FIELD_SLEEP_PERF;
 
-    std::vector<ScanStation> stations;
-    const ScanData *scans = (ScanData*)(packet + 1);
-    const ScanData *end = scans + packet->station_count;
-    for (; scans < end; scans++) {
-        stations.emplace_back(MacAddress(scans->bssid.mac),
-                              (int8_t)scans->rssi - 128,
-                              scans->channel);
-    }
+    return changed;
+}
 
-    return Scan(MacAddress(packet->base.mac.mac),
-                packet->timestamp,
-                std::move(stations));
+void Status::apply(const Status &from, uint16_t fields) {
+    if (fields & FIELD_MAC)            _mac = from._mac;
+    if (fields & FIELD_VERSION)        _version = from._version;
+    if (fields & FIELD_RSSI)           _rssi = from._rssi;
+    if (fields & FIELD_BSSID)          _bssid = from._bssid;
+    if (fields & FIELD_GPIO_STATE)     _gpio_state = from._gpio_state;
+    if (fields & FIELD_LAST_BUTTON)    _last_button = from._last_button;
+    if (fields & FIELD_BUTTON_DOWN)    _button_down = from._button_down;
+    if (fields & FIELD_SYSTEM_VOLTAGE) _system_voltage = from._system_voltage;
+    if (fields & FIELD_UPDATE_COUNT)   _update_count = from._update_count;
+    if (fields & FIELD_HEAP_FREE)      _heap_free = from._heap_free;
+    if (fields & FIELD_SLEEP_PERF)     _sleep_performance = from._sleep_performance;
+    if (fields & FIELD_TIME)           _time = from._time;
 }
@@ -53,6 +53,7 @@ enum PACKET_TYPE {
 };
 
 const char button_char(BUTTON b);
+BUTTON button_from_char(char c);
 
 static const std::string &STRBUTTON_NONE("none");
 static const std::string STRBUTTON_RIGHT("right");
@@ -156,6 +157,14 @@ struct PACKED ConfigurePacket {
     uint8_t raw_rate; // 0x1a is recommended
 };
 
+struct PACKED DeepSleepPacket {
+    BasePacket base;
+};
+
+struct PACKED StatusRequestPacket {
+    BasePacket base;
+};
+
 struct PACKED TextPacket {
     BasePacket base;
 
@@ -198,6 +207,73 @@ public:
     }
 };
 
+enum STATUS_FIELD {
+    FIELD_VERSION        = 0x0001,
+    FIELD_RSSI           = 0x0002,
+    FIELD_BSSID          = 0x0004,
+    FIELD_GPIO_STATE     = 0x0008,
+    FIELD_LAST_BUTTON    = 0x0010,
+    FIELD_BUTTON_DOWN    = 0x0020,
+    FIELD_SYSTEM_VOLTAGE = 0x0040,
+    FIELD_UPDATE_COUNT   = 0x0080,
+    FIELD_HEAP_FREE      = 0x0100,
+    FIELD_SLEEP_PERF     = 0x0200,
+    FIELD_TIME           = 0x0400,
+    FIELD_MAC            = 0x0800,
+};
+
+// The fields that describe the badge rather than the packet, and so are worth reporting when they change
+static const uint16_t STATUS_DELTA_FIELDS = FIELD_VERSION | FIELD_RSSI | FIELD_BSSID | FIELD_GPIO_STATE
+                                            | FIELD_SYSTEM_VOLTAGE | FIELD_HEAP_FREE | FIELD_SLEEP_PERF;
+
+/**
+ * How far the noisy STATUS fields have to move before a change is reported
+ */
+struct StatusThresholds {
+    int rssi;
+    int system_voltage;
+    int heap_free;
+
+    StatusThresholds()
+            : rssi(5),
+              system_voltage(50),
+              heap_free(1024) {}
+};
+
+/**
+ * A STATUS packet read in place from the receive buffer. The length is checked once by valid(), and each
+ * field is only decoded when it is asked for.
+ */
+class StatusView {
+    const StatusPacket *_packet;
+
+public:
+    explicit StatusView(const char *data)
+            : _packet(reinterpret_cast<const StatusPacket*>(data)) {}
+
+    static bool valid(const char *data, size_t len) {
+        return len >= sizeof(StatusPacket)
+               && reinterpret_cast<const BasePacket*>(data)->type == (uint8_t)PACKET_TYPE::STATUS;
+    }
+
+    uint64_t          mac()         const { return (uint64_t)MacAddress(_packet->base.mac.mac); }
+    MacAddress        mac_address() const { return MacAddress(_packet->base.mac.mac); }
+    int               version()     const { return _packet->version; }
+    int8_t            rssi()        const { return (int8_t)(_packet->rssi - 128); }
+    MacAddress        bssid()       const { return MacAddress(_packet->bssid.mac); }
+    uint8_t           gpio_state()  const { return _packet->gpio_state; }
+
+    bool              button_down() const { return _packet->button_down != 0; }
+    BUTTON            last_button() const { return (BUTTON)_packet->last_button; }
+    const std::string &last_button_name() const { return button_name(last_button()); }
+
+    uint16_t          system_voltage() const { return ntohs(_packet->system_voltage); }
+    uint16_t          update_count() const { return ntohs(_packet->update_count); }
+    uint16_t          heap_free()   const { return ntohs(_packet->heap_free); }
+    uint8_t           sleep_performance() const { return _packet->sleep_perf; }
+    uint32_t          time()        const { return ntohl(_packet->time); }
+};
+
 class Status {
     int _version;
     MacAddress _mac;
@@ -255,7 +331,26 @@ public:
               _sleep_performance(sleep_performance),
               _time(time) {}
 
-    static const Status decode_from_packet(const StatusPacket *packet);
+    /**
+     * Copies in the fields of a packet that differ from what we have
+     * @param view
+     * @return the STATUS_FIELD bits that changed
+     */
+    uint16_t update(const StatusView &view);
+
+    /**
+     * @param since what was last reported
+     * @param thresholds
+     * @return the STATUS_DELTA_FIELDS bits that have changed enough since then
+     */
+    uint16_t changes(const Status &since, const StatusThresholds &thresholds) const;
+
+    /**
+     * Copies some fields from another status
+     * @param from
+     * @param fields STATUS_FIELD bits
+     */
+    void apply(const Status &from, uint16_t fields);
 
     const MacAddress &mac_address() const { return _mac; }
     int               version()     const { return _version; }
@@ -321,20 +416,79 @@ public:
     uint8_t           channel() const { return _channel;}
 };
 
+/**
+ * A SCAN packet read in place from the receive buffer. valid() checks that all station_count stations
+ * fit in the datagram, and stations are only decoded when they're asked for.
+ */
+class ScanView {
+    const ScanPacket *_packet;
+
+    const ScanData *data() const { return reinterpret_cast<const ScanData*>(_packet + 1); }
+
+public:
+    explicit ScanView(const char *data)
+            : _packet(reinterpret_cast<const ScanPacket*>(data)) {}
+
+    static bool valid(const char *data, size_t len) {
+        if (len < sizeof(ScanPacket)) {
+            return false;
+        }
+
+        auto packet = reinterpret_cast<const ScanPacket*>(data);
+        return packet->base.type == (uint8_t)PACKET_TYPE::SCAN
+               && len >= sizeof(ScanPacket) + packet->station_count * sizeof(ScanData);
+    }
+
+    uint64_t          mac()           const { return (uint64_t)MacAddress(_packet->base.mac.mac); }
+    MacAddress        mac_address()   const { return MacAddress(_packet->base.mac.mac); }
+    uint32_t          timestamp()     const { return _packet->timestamp; }
+    size_t            station_count() const { return _packet->station_count; }
+
+    ScanStation station(size_t i) const {
+        return ScanStation(MacAddress(data()[i].bssid.mac),
+                           (int8_t)(data()[i].rssi - 128),
+                           data()[i].channel);
+    }
+};
+
+/**
+ * The stations a badge reported in one scan, which may arrive over several SCAN packets with the same
+ * timestamp. At most MAX_STATIONS are kept: a BSSID heard twice keeps its strongest reading, and once the
+ * scan is full a new station only gets in by replacing a weaker one.
+ */
 class Scan {
+public:
+    static const size_t MAX_STATIONS = 32;
+
+private:
     MacAddress _mac;
     uint32_t _timestamp;
     std::vector<ScanStation> _stations;
 
-    Scan(MacAddress mac,
-         uint32_t timestamp,
-         const std::vector<ScanStation> &&stations)
-            : _mac(mac),
-              _timestamp(timestamp),
-              _stations(std::move(stations)) {}
+    void add(const ScanStation &station) {
+        auto weakest = _stations.end();
+
+        for (auto it = _stations.begin(); it != _stations.end(); ++it) {
+            if ((uint64_t)it->mac() == (uint64_t)station.mac()) {
+                if (station.rssi() > it->rssi()) {
+                    *it = station;
+                }
+                return;
+            }
+
+            if (weakest == _stations.end() || it->rssi() < weakest->rssi()) {
+                weakest = it;
+            }
+        }
+
+        if (_stations.size() < MAX_STATIONS) {
+            _stations.push_back(station);
+        } else if (station.rssi() > weakest->rssi()) {
+            *weakest = station;
+        }
+    }
 
 public:
-    static const Scan decode_from_packet(const ScanPacket *packet);
 
     Scan()
     : _mac(MacAddress::null_mac()),
@@ -345,13 +499,32 @@ public:
     const uint32_t    timestamp()   const { return _timestamp; }
     const std::vector<ScanStation> &stations() const { return _stations; }
 
-    bool update(const Scan &other) {
-        if (other._timestamp == _timestamp) {
-            _stations.insert(_stations.end(), other._stations.begin(), other._stations.end());
-            return true;
+    /**
+     * @param view
+     * @return whether the packet is a fragment of this scan
+     */
+    bool same_scan(const ScanView &view) const {
+        return view.timestamp() == _timestamp && (uint64_t)_mac == view.mac();
+    }
+
+    /**
+     * Adds the stations from another fragment of this scan, or starts over if the packet is from a new one
+     * @param view
+     * @return false if this started a new scan
+     */
+    bool update(const ScanView &view) {
+        bool same = same_scan(view);
+        if (!same) {
+            _mac = view.mac_address();
+            _timestamp = view.timestamp();
+            _stations.clear();
+        }
+
+        for (size_t i = 0; i < view.station_count(); i++) {
+            add(view.station(i));
         }
 
-        return false;
+        return same;
     }
 
     friend std::ostream& operator<< (std::ostream &stream, const Scan &scan) {
@@ -0,0 +1,331 @@
+#ifndef REGISTRY_H
+#define REGISTRY_H
+
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <memory>
+#include <vector>
+#include <type_traits>
+#include <new>
+#include <utility>
+#include <cstdint>
+
+/**
+ * Badge lookup table written by exactly one thread (the ingest worker that owns the badges) and read from
+ * any number of others.
+ *
+ * Badges live in fixed-size chunks that never move once allocated. Each chunk holds the hot records (T)
+ * back to back and, in a separate array, the cold record for each one (C), so walking or probing badges
+ * never drags the bulky fields into cache.
+ *
+ * Badges are located through an open-addressed index of atomic key/slot pairs, one per 16 bytes so a
+ * probe usually costs a single cache line. A writer fills in the slot before publishing the key, so a
+ * reader that sees the key always sees a complete entry; lookups are a bounded probe with no locks and
+ * no retries. Erasing a badge leaves a tombstone in its entry, which probes go past and inserts reuse.
+ *
+ * The index is never resized in place. When live entries and tombstones fill half of it the writer builds
+ * a new one, twice the size if the badges alone fill a quarter, and swaps the pointer; readers still
+ * probing the old one just see it without the newest changes.
+ *
+ * Nothing a reader might still be looking at is reused straight away. An erased badge's records are left
+ * as they are, and they and an index that has been replaced are only destroyed and recycled once they
+ * have been retired for the reuse delay, so a pointer handed to a reader stays valid for at least that
+ * long after its badge goes.
+ */
+template<typename T, typename C>
+class BadgeRegistry {
+    static const size_t CHUNK_SIZE = 1024;
+    static const size_t MAX_CHUNKS = 4096;
+    static const uint64_t OCCUPIED = 1ull << 63;
+    // MACs are 48 bits, so no real key can look like this
+    static const uint64_t TOMBSTONE = ~0ull;
+
+    typedef std::chrono::steady_clock Clock;
+
+    struct Chunk {
+        typename std::aligned_storage<sizeof(T), alignof(T)>::type hot[CHUNK_SIZE];
+        typename std::aligned_storage<sizeof(C), alignof(C)>::type cold[CHUNK_SIZE];
+        std::atomic<bool> live[CHUNK_SIZE];
+    };
+
+    struct Entry {
+        std::atomic<uint64_t> key;
+        std::atomic<uint32_t> slot;
+    };
+
+    struct Index {
+        size_t mask;
+        std::unique_ptr<Entry[]> entries;
+        // Entries that aren't empty, tombstones included
+        size_t used;
+
+        explicit Index(size_t capacity)
+                : mask(capacity - 1),
+                  entries(new Entry[capacity]),
+                  used(0) {
+            for (size_t i = 0; i < capacity; i++) {
+                entries[i].key.store(0, std::memory_order_relaxed);
+                entries[i].slot.store(0, std::memory_order_relaxed);
+            }
+        }
+
+        size_t capacity() const { return mask + 1; }
+
+        void put(uint64_t mac, uint32_t slot) {
+            for (size_t i = hash(mac) & mask;; i = (i + 1) & mask) {
+                uint64_t key = entries[i].key.load(std::memory_order_relaxed);
+                if (key == 0 || key == TOMBSTONE) {
+                    used += key == 0;
+                    // Released so a reader that sees the new slot also sees the tombstone that came before it
+                    entries[i].slot.store(slot, std::memory_order_release);
+                    entries[i].key.store(mac | OCCUPIED, std::memory_order_release);
+                    return;
+                }
+            }
+        }
+
+        void remove(uint64_t mac) {
+            uint64_t key = mac | OCCUPIED;
+            for (size_t i = hash(mac) & mask;; i = (i + 1) & mask) {
+                uint64_t found = entries[i].key.load(std::memory_order_relaxed);
+                if (found == key) {
+                    entries[i].key.store(TOMBSTONE, std::memory_order_release);
+                    return;
+                } else if (found == 0) {
+                    return;
+                }
+            }
+        }
+
+        bool get(uint64_t mac, uint32_t &slot) const {
+            uint64_t key = mac | OCCUPIED;
+            for (size_t i = hash(mac) & mask;; i = (i + 1) & mask) {
+                uint64_t found = entries[i].key.load(std::memory_order_acquire);
+                if (found == key) {
+                    // A tombstoned entry can be reused for another badge between reading the key and the
+                    // slot, so the slot only counts if the key is still ours afterwards; if it isn't, the
+                    // badge was erased while we looked
+                    slot = entries[i].slot.load(std::memory_order_acquire);
+                    return entries[i].key.load(std::memory_order_acquire) == key;
+                } else if (found == 0) {
+                    return false;
+                }
+            }
+        }
+    };
+
+    std::atomic<Index*> _index;
+    std::unique_ptr<Index> _current;
+
+    std::atomic<Chunk*> _chunks[MAX_CHUNKS];
+    // Slots handed out so far, and how many of them hold a badge now
+    std::atomic<uint32_t> _size;
+    std::atomic<uint32_t> _live;
+
+    // Erased slots and replaced indexes, oldest first, waiting out the reuse delay
+    Clock::duration _reuse_delay;
+    std::deque<std::pair<uint32_t, Clock::time_point>> _free_slots;
+    std::deque<std::pair<std::unique_ptr<Index>, Clock::time_point>> _retired_indexes;
+
+    static size_t hash(uint64_t mac) {
+        // Badges share a vendor prefix, so mix everything down into the high bits and use those
+        return (size_t)((mac * 0x9E3779B97F4A7C15ull) >> 32);
+    }
+
+    T *at(uint32_t slot) const {
+        Chunk *chunk = _chunks[slot / CHUNK_SIZE].load(std::memory_order_acquire);
+        return reinterpret_cast<T*>(&chunk->hot[slot % CHUNK_SIZE]);
+    }
+
+    C *cold_at(uint32_t slot) const {
+        Chunk *chunk = _chunks[slot / CHUNK_SIZE].load(std::memory_order_acquire);
+        return reinterpret_cast<C*>(&chunk->cold[slot % CHUNK_SIZE]);
+    }
+
+    bool live_at(uint32_t slot) const {
+        Chunk *chunk = _chunks[slot / CHUNK_SIZE].load(std::memory_order_acquire);
+        return chunk->live[slot % CHUNK_SIZE].load(std::memory_order_acquire);
+    }
+
+    void rebuild() {
+        size_t capacity = _current->capacity();
+        if ((_live.load(std::memory_order_relaxed) + 1) * 4 > capacity) {
+            capacity *= 2;
+        }
+
+        std::unique_ptr<Index> index(new Index(capacity));
+
+        uint32_t size = _size.load(std::memory_order_relaxed);
+        for (uint32_t slot = 0; slot < size; slot++) {
+            if (live_at(slot)) {
+                index->put(at(slot)->mac(), slot);
+            }
+        }
+
+        _index.store(index.get(), std::memory_order_release);
+        _retired_indexes.emplace_back(std::move(_current), Clock::now());
+        _current = std::move(index);
+    }
+
+    void release_indexes(Clock::time_point now) {
+        while (!_retired_indexes.empty() && now - _retired_indexes.front().second >= _reuse_delay) {
+            _retired_indexes.pop_front();
+        }
+    }
+
+public:
+    /**
+     * @param capacity how many badges to make room for up front
+     * @param reuse_delay how long an erased badge's memory is left alone before it is reused
+     */
+    explicit BadgeRegistry(size_t capacity = 256,
+                           std::chrono::milliseconds reuse_delay = std::chrono::seconds(10))
+            : _index(nullptr),
+              _current(),
+              _size(0),
+              _live(0),
+              _reuse_delay(reuse_delay),
+              _free_slots(),
+              _retired_indexes() {
+        size_t size = 16;
+        while (size < capacity * 2) size <<= 1;
+
+        _current.reset(new Index(size));
+        _index.store(_current.get(), std::memory_order_release);
+
+        for (auto &chunk : _chunks) {
+            chunk.store(nullptr, std::memory_order_relaxed);
+        }
+    }
+
+    ~BadgeRegistry() {
+        uint32_t size = _size.load(std::memory_order_acquire);
+        for (uint32_t slot = 0; slot < size; slot++) {
+            if (live_at(slot)) {
+                at(slot)->~T();
+                cold_at(slot)->~C();
+            }
+        }
+
+        // Erased badges keep their records until their slot is reused
+        for (auto &free_slot : _free_slots) {
+            at(free_slot.first)->~T();
+            cold_at(free_slot.first)->~C();
+        }
+
+        for (auto &chunk : _chunks) {
+            delete chunk.load(std::memory_order_relaxed);
+        }
+    }
+
+    BadgeRegistry(const BadgeRegistry&) = delete;
+    BadgeRegistry &operator=(const BadgeRegistry&) = delete;
+
+    /**
+     * Safe from any thread
+     * @param mac
+     * @return the badge, or nullptr if it hasn't been seen
+     */
+    T *find(uint64_t mac) const {
+        uint32_t slot;
+        if (_index.load(std::memory_order_acquire)->get(mac, slot)) {
+            return at(slot);
+        }
+
+        return nullptr;
+    }
+
+    /**
+     * Adds a badge that isn't in the registry yet. Only the owning thread may call this.
+     * @param mac
+     * @param args forwarded to the badge constructor, after a pointer to its default constructed cold record
+     * @return the new badge, or nullptr if the registry is full
+     */
+    template<typename... Args>
+    T *insert(uint64_t mac, Args&&... args) {
+        Clock::time_point now = Clock::now();
+        bool reused = !_free_slots.empty() && now - _free_slots.front().second >= _reuse_delay;
+
+        uint32_t slot = reused ? _free_slots.front().first : _size.load(std::memory_order_relaxed);
+        if (slot >= CHUNK_SIZE * MAX_CHUNKS) {
+            return nullptr;
+        }
+
+        if ((_current->used + 1) * 2 > _current->capacity()) {
+            release_indexes(now);
+            rebuild();
+        }
+
+        Chunk *chunk = _chunks[slot / CHUNK_SIZE].load(std::memory_order_relaxed);
+        if (chunk == nullptr) {
+            chunk = new Chunk();
+            _chunks[slot / CHUNK_SIZE].store(chunk, std::memory_order_release);
+        }
+
+        if (reused) {
+            at(slot)->~T();
+            cold_at(slot)->~C();
+        }
+
+        C *cold = new (&chunk->cold[slot % CHUNK_SIZE]) C();
+        T *badge = new (&chunk->hot[slot % CHUNK_SIZE]) T(cold, std::forward<Args>(args)...);
+        chunk->live[slot % CHUNK_SIZE].store(true, std::memory_order_release);
+
+        if (reused) {
+            _free_slots.pop_front();
+        } else {
+            _size.store(slot + 1, std::memory_order_release);
+        }
+        _live.fetch_add(1, std::memory_order_relaxed);
+
+        _current->put(mac, slot);
+        return badge;
+    }
+
+    /**
+     * Forgets a badge. Only the owning thread may call this, and the badge mustn't be used by it afterwards;
+     * its records aren't destroyed until the slot is reused, so other threads may go on reading them for
+     * the reuse delay.
+     * @param mac
+     * @return false if there was no such badge
+     */
+    bool erase(uint64_t mac) {
+        uint32_t slot;
+        if (!_current->get(mac, slot)) {
+            return false;
+        }
+
+        _current->remove(mac);
+
+        Chunk *chunk = _chunks[slot / CHUNK_SIZE].load(std::memory_order_relaxed);
+        chunk->live[slot % CHUNK_SIZE].store(false, std::memory_order_release);
+
+        Clock::time_point now = Clock::now();
+        _free_slots.emplace_back(slot, now);
+        _live.fetch_sub(1, std::memory_order_relaxed);
+        release_indexes(now);
+
+        return true;
+    }
+
+    size_t size() const {
+        return _live.load(std::memory_order_acquire);
+    }
+
+    /**
+     * Visits every badge that was in the registry when the call started and still is. Safe from any thread.
+     * @param f called with each badge
+     */
+    template<typename F>
+    void for_each(F f) const {
+        uint32_t size = _size.load(std::memory_order_acquire);
+        for (uint32_t slot = 0; slot < size; slot++) {
+            if (live_at(slot)) {
+                f(*at(slot));
+            }
+        }
+    }
+};
+
+#endif
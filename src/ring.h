@@ -0,0 +1,107 @@
+#ifndef RING_H
+#define RING_H
+
+#include <atomic>
+#include <memory>
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * Bounded lock-free queue for many producers and a single consumer.
+ *
+ * Every cell carries a sequence number that tells producers whether it is free for the lap they are on
+ * and tells the consumer whether it has been published yet (D. Vyukov's bounded queue). Producers never
+ * wait on each other or on the consumer: try_push simply fails when the ring is full.
+ */
+template<typename T>
+class MpscRing {
+    struct Cell {
+        std::atomic<size_t> sequence;
+        T data;
+    };
+
+    std::unique_ptr<Cell[]> _cells;
+    size_t _mask;
+
+    // Padded rather than aligned, so that rings can be members of objects made with new before C++17
+    char _head_pad[64];
+    std::atomic<size_t> _head;
+    char _tail_pad[64 - sizeof(std::atomic<size_t>)];
+    size_t _tail;
+
+public:
+    /**
+     * @param capacity rounded up to a power of two
+     */
+    explicit MpscRing(size_t capacity)
+            : _cells(),
+              _mask(0),
+              _head_pad(),
+              _head(0),
+              _tail_pad(),
+              _tail(0) {
+        size_t size = 1;
+        while (size < capacity) size <<= 1;
+
+        _cells.reset(new Cell[size]);
+        _mask = size - 1;
+
+        for (size_t i = 0; i < size; i++) {
+            _cells[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    size_t capacity() const { return _mask + 1; }
+
+    /**
+     * Safe to call from any thread
+     * @param value
+     * @return false if the ring is full
+     */
+    bool try_push(const T &value) {
+        Cell *cell;
+        size_t pos = _head.load(std::memory_order_relaxed);
+
+        for (;;) {
+            cell = &_cells[pos & _mask];
+            size_t seq = cell->sequence.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+
+            if (diff == 0) {
+                if (_head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (diff < 0) {
+                // The consumer hasn't freed this cell from the previous lap yet
+                return false;
+            } else {
+                pos = _head.load(std::memory_order_relaxed);
+            }
+        }
+
+        cell->data = value;
+        cell->sequence.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    /**
+     * Must only be called from the consumer thread
+     * @param value
+     * @return false if nothing has been published
+     */
+    bool try_pop(T &value) {
+        Cell &cell = _cells[_tail & _mask];
+        size_t seq = cell.sequence.load(std::memory_order_acquire);
+
+        if ((intptr_t)seq - (intptr_t)(_tail + 1) < 0) {
+            return false;
+        }
+
+        value = cell.data;
+        cell.sequence.store(_tail + _mask + 1, std::memory_order_release);
+        _tail++;
+        return true;
+    }
+};
+
+#endif
@@ -0,0 +1,96 @@
+#include <errno.h>
+#include <string.h>
+
+#include "send_queue.h"
+#include "log.h"
+
+thread_local SendQueue *SendQueue::_current = nullptr;
+
+SendQueue::SendQueue(int sockfd, size_t capacity, std::chrono::microseconds deadline, size_t slot_size)
+        : _sockfd(sockfd),
+          _slot_size(slot_size),
+          _deadline(deadline),
+          _data((capacity > 0 ? capacity : 1) * slot_size),
+          _msgs(capacity > 0 ? capacity : 1),
+          _iovecs(capacity > 0 ? capacity : 1),
+          _addrs(capacity > 0 ? capacity : 1),
+          _count(0),
+          _oldest(),
+          _send_calls(0),
+          _packets_sent(0) {
+    for (size_t i = 0; i < _msgs.size(); i++) {
+        _iovecs[i].iov_base = &_data[i * slot_size];
+
+        _msgs[i].msg_hdr = {};
+        _msgs[i].msg_hdr.msg_iov = &_iovecs[i];
+        _msgs[i].msg_hdr.msg_iovlen = 1;
+        _msgs[i].msg_hdr.msg_name = &_addrs[i];
+        _msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+    }
+}
+
+char *SendQueue::reserve(const struct sockaddr_in &address, size_t len) {
+    if (len > _slot_size) {
+        return nullptr;
+    }
+
+    if (_count > 0 && (_count == _msgs.size() || std::chrono::steady_clock::now() - _oldest > _deadline)) {
+        flush();
+    }
+
+    if (_count == 0) {
+        _oldest = std::chrono::steady_clock::now();
+    }
+
+    _addrs[_count] = address;
+    _iovecs[_count].iov_len = len;
+    return &_data[_count++ * _slot_size];
+}
+
+void SendQueue::push(const struct sockaddr_in &address, const char *packet, size_t len) {
+    char *slot = reserve(address, len);
+    if (slot != nullptr) {
+        memcpy(slot, packet, len);
+        return;
+    }
+
+    // Keep the packets in order even though this one can't go in the queue
+    flush();
+    if (_sockfd >= 0) {
+        sendto(_sockfd, packet, len, 0, (const struct sockaddr*)&address, sizeof(address));
+        _send_calls++;
+    }
+
+    _packets_sent++;
+}
+
+void SendQueue::flush() {
+    if (_sockfd < 0) {
+        _packets_sent += _count;
+        _count = 0;
+        return;
+    }
+
+    size_t sent = 0;
+
+    while (sent < _count) {
+        int res = sendmmsg(_sockfd, &_msgs[sent], (unsigned int)(_count - sent), 0);
+        _send_calls++;
+
+        if (res < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            // Datagrams are best-effort anyway, so drop the rest rather than stall the ingest loop
+            logger().message(LogLevel::WARN, "sendmmsg failed (errno %llu), dropped %llu packets",
+                             (uint64_t)errno, _count - sent);
+            break;
+        }
+
+        sent += res;
+        _packets_sent += res;
+    }
+
+    _count = 0;
+}
@@ -0,0 +1,99 @@
+#ifndef SEND_QUEUE_H
+#define SEND_QUEUE_H
+
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <chrono>
+#include <vector>
+#include <cstdint>
+
+/**
+ * Outbound datagrams waiting to go out together in one sendmmsg call.
+ *
+ * A queue belongs to one thread. While a Scope is active, Server::send_packet on that thread appends to
+ * the queue instead of calling sendto. The queue goes out when it fills up, when the oldest packet has
+ * waited longer than the deadline, or when its owner calls flush (the ingest loop does after every batch).
+ * A queue without a socket drops everything it is given, still counting it as sent; replays use one.
+ */
+class SendQueue {
+    static thread_local SendQueue *_current;
+
+    int _sockfd;
+    size_t _slot_size;
+    std::chrono::microseconds _deadline;
+
+    std::vector<char> _data;
+    std::vector<struct mmsghdr> _msgs;
+    std::vector<struct iovec> _iovecs;
+    std::vector<struct sockaddr_in> _addrs;
+
+    size_t _count;
+    std::chrono::steady_clock::time_point _oldest;
+
+    uint64_t _send_calls;
+    uint64_t _packets_sent;
+
+public:
+    /**
+     * Makes a queue the one send_packet uses on this thread for as long as the Scope lives, and flushes
+     * it on the way out.
+     */
+    class Scope {
+        SendQueue &_queue;
+        SendQueue *_previous;
+
+    public:
+        explicit Scope(SendQueue &queue)
+                : _queue(queue),
+                  _previous(_current) {
+            _current = &queue;
+        }
+
+        ~Scope() {
+            _queue.flush();
+            _current = _previous;
+        }
+
+        Scope(const Scope&) = delete;
+        Scope &operator=(const Scope&) = delete;
+    };
+
+    SendQueue(int sockfd,
+              size_t capacity = 64,
+              std::chrono::microseconds deadline = std::chrono::microseconds(1000),
+              size_t slot_size = 256);
+
+    SendQueue(const SendQueue&) = delete;
+    SendQueue &operator=(const SendQueue&) = delete;
+
+    /**
+     * @return the queue for this thread, or nullptr if packets should be sent straight away
+     */
+    static SendQueue *current() { return _current; }
+
+    /**
+     * Reserves room for a packet, flushing first if the queue is full or overdue
+     * @param address
+     * @param len
+     * @return where to write the packet, or nullptr if it is too big to queue
+     */
+    char *reserve(const struct sockaddr_in &address, size_t len);
+
+    /**
+     * Queues a copy of a packet; packets too big to queue are sent immediately, after what's queued
+     * @param address
+     * @param packet
+     * @param len
+     */
+    void push(const struct sockaddr_in &address, const char *packet, size_t len);
+
+    void flush();
+
+    size_t size() const { return _count; }
+    bool empty() const { return _count == 0; }
+
+    uint64_t send_calls() const { return _send_calls; }
+    uint64_t packets_sent() const { return _packets_sent; }
+};
+
+#endif
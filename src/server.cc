@@ -2,33 +2,35 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
-#include <netdb.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
+#include <linux/filter.h>
+#include <sys/eventfd.h>
+#include <errno.h>
+#include <algorithm>
 #include <iostream>
+#include <thread>
 
 #include "packets.h"
 #include "server.h"
+#include "log.h"
+#include "send_queue.h"
+#include "event_loop.h"
+#include "capture.h"
 
 #define BUFSIZE 1024
 #define PORT 8000
-
-void set_mac_address(uint8_t *data, uint64_t mac) {
-    data[0] = (uint8_t)((mac >> 40) & 0xff);
-    data[1] = (uint8_t)((mac >> 32) & 0xff);
-    data[2] = (uint8_t)((mac >> 24) & 0xff);
-    data[3] = (uint8_t)((mac >> 16) & 0xff);
-    data[4] = (uint8_t)((mac >> 8) & 0xff);
-    data[5] = (uint8_t)(mac & 0xff);
-}
+#define STATS_INTERVAL_MS 60000
+// A scan is published once no more of its fragments have arrived for this long
+#define SCAN_TIMEOUT_MS 200
+// How finely badge timeouts are tracked
+#define EXPIRY_TICK_MS 100
+// Lines of text whose y is closer than this can overlap on a badge's screen
+#define LINE_HEIGHT 16
 
 void BadgeInfo::scan() {
-    ScanRequestPacket packet{};
-    packet.base.type = SCAN_REQUEST;
-    set_mac_address(packet.base.mac.mac, _mac);
-
-    _server->send_packet(this, (char*)&packet, sizeof(ScanPacket));
+    _server->send<SCAN_REQUEST>(*this);
 }
 
 void BadgeInfo::set_lights(uint8_t r1, uint8_t g1, uint8_t b1,
@@ -36,56 +38,113 @@ void BadgeInfo::set_lights(uint8_t r1, uint8_t g1, uint8_t b1,
                            uint8_t r3, uint8_t g3, uint8_t b3,
                            uint8_t r4, uint8_t g4, uint8_t b4,
                            uint8_t mask, uint8_t match) {
-    LightsPacket packet{};
-    packet.base.type = LIGHTS;
-    set_mac_address(packet.base.mac.mac, _mac);
+    const LightData lights[4] {
+            {g1, r1, b1},
+            {g2, r2, b2},
+            {g3, r3, b3},
+            {g4, r4, b4},
+    };
+
+    set_lights(lights, mask, match);
+}
+
+void BadgeInfo::set_lights(const LightData (&lights)[4], uint8_t mask, uint8_t match) {
+    _server->send_lights(*this, lights, mask, match);
+}
+
+void BadgeInfo::send_held_lights(uint32_t now_ms) {
+    _server->send<LIGHTS>(*this, _cold->held_lights, _cold->held_mask, _cold->held_match);
+    _cold->lights_held = false;
+    _cold->lights_sent = now_ms;
+}
+
+bool BadgeInfo::set_text(uint8_t x, uint8_t y, uint8_t style, const std::string &text) {
+    auto &screen = _cold->screen;
+    auto line = std::find_if(screen.begin(), screen.end(), [&](const ScreenLine &shown) {
+        return shown.at(x, y, style);
+    });
+
+    if (line != screen.end()) {
+        if (line->text == text) {
+            return false;
+        }
+
+        line->text = text;
+    } else {
+        // A line written anywhere else close by may have been drawn over, so it can't be trusted any more
+        screen.erase(std::remove_if(screen.begin(), screen.end(), [&](const ScreenLine &shown) {
+            return std::abs((int)shown.y - (int)y) < LINE_HEIGHT;
+        }), screen.end());
 
-    packet.mask = mask;
-    packet.match = match;
+        screen.push_back(ScreenLine{x, y, style, text});
+    }
 
-    packet.lights[0].red   = r1;
-    packet.lights[0].green = g1;
-    packet.lights[0].blue  = b1;
+    logger().text(LogLevel::DEBUG, _mac, x, y, text.size());
 
-    packet.lights[1].red   = r2;
-    packet.lights[1].green = g2;
-    packet.lights[1].blue  = b2;
+    _server->send<TEXT>(*this, x, y, style, text);
+    return true;
+}
 
-    packet.lights[2].red   = r3;
-    packet.lights[2].green = g3;
-    packet.lights[2].blue  = b3;
+size_t BadgeInfo::set_screen(const std::vector<ScreenLine> &lines) {
+    std::vector<ScreenLine> stale;
+    for (const auto &shown : _cold->screen) {
+        bool kept = std::any_of(lines.begin(), lines.end(), [&](const ScreenLine &line) {
+            return line.at(shown.x, shown.y, shown.style);
+        });
 
-    packet.lights[3].red   = r4;
-    packet.lights[3].green = g4;
-    packet.lights[3].blue  = b4;
+        if (!kept) {
+            stale.push_back(shown);
+        }
+    }
 
-    _server->send_packet(this, (char*)&packet, sizeof(LightsPacket));
+    // Blank first, so nothing new is wiped out by a line it overlaps
+    for (const auto &line : stale) {
+        set_text(line.x, line.y, line.style, std::string(line.text.size(), ' '));
+    }
+
+    size_t unchanged = 0;
+    for (const auto &line : lines) {
+        unchanged += !set_text(line.x, line.y, line.style, line.text);
+    }
+
+    return unchanged;
 }
 
-void BadgeInfo::set_text(uint8_t x, uint8_t y, uint8_t style, const std::string &text) {
-    size_t data_len = sizeof(TextPacket) + text.size();
-    uint8_t *data = (uint8_t*)alloca(data_len);
-    auto *packet = reinterpret_cast<TextPacket*>(data);
+void BadgeInfo::set_lights_rssi(uint8_t min_rssi, uint8_t max_rssi, uint8_t led_intensity) {
+    _server->send<LIGHTS_RSSI>(*this, min_rssi, max_rssi, led_intensity);
+}
 
-    packet->base.type = TEXT;
-    set_mac_address(packet->base.mac.mac, _mac);
-    packet->x = x;
-    packet->y = y;
-    packet->opts = style;
+void BadgeInfo::set_lights_rainbow(uint16_t runtime, uint8_t speed, uint8_t intensity, uint8_t offset) {
+    _server->send<LIGHTS_RAINBOW>(*this, runtime, speed, intensity, offset);
+}
 
-    std::cout << "len " << text.size() << std::endl;
+void BadgeInfo::configure(uint8_t requested_update, uint8_t disable_push, uint8_t disable_raw, uint8_t raw_rate) {
+    _server->send<CONFIG>(*this, requested_update, disable_push, disable_raw, raw_rate);
+}
 
-    memcpy(&packet->text, text.c_str(), text.size() + 1);
+void BadgeInfo::deep_sleep() {
+    _server->send<DEEP_SLEEP>(*this);
+}
 
-    _server->send_packet(this, (char*)data, data_len);
+void BadgeInfo::request_status() {
+    _server->send<STATUS_REQUEST>(*this);
 }
 
 const std::vector<uint64_t> Server::game_players(const std::string &game_id) {
     std::vector<uint64_t> players;
-    for (const auto &player : _badge_ips) {
-        if (player.second.in_game() && player.second.current_game()->name() == game_id) {
-            players.push_back(player.second.mac());
-        }
+
+    auto current_games = games();
+    const GameInfo *game = current_games->find(game_id);
+    if (game == nullptr) {
+        return players;
+    }
+
+    for (const auto &shard : _shards) {
+        shard->_badges.for_each([&](const BadgeInfo &player) {
+            if (player.game_id() == game->id()) {
+                players.push_back(player.mac());
+            }
+        });
     }
 
     return players;
@@ -93,204 +152,907 @@ const std::vector<uint64_t> Server::game_players(const std::string &game_id) {
 
 const std::vector<uint64_t> Server::all_badges() {
     std::vector<uint64_t> badges;
-    for (const auto &badge : _badge_ips) {
-        badges.push_back(badge.first);
+    for (const auto &shard : _shards) {
+        shard->_badges.for_each([&](const BadgeInfo &badge) {
+            badges.push_back(badge.mac());
+        });
     }
 
     return badges;
 }
 
+static uint64_t expiry_tick() {
+    using namespace std::chrono;
+    return (uint64_t)duration_cast<milliseconds>(steady_clock::now().time_since_epoch()).count() / EXPIRY_TICK_MS;
+}
+
+uint64_t Server::recv_calls() const {
+    uint64_t total = 0;
+    for (const auto &shard : _shards) {
+        total += shard->_recv_calls;
+    }
+
+    return total;
+}
+
+uint64_t Server::packets_received() const {
+    uint64_t total = 0;
+    for (const auto &shard : _shards) {
+        total += shard->_packets_received;
+    }
+
+    return total;
+}
+
+Shard::Shard(size_t index)
+        : _index(index),
+          _sockfd(-1),
+          _commands(COMMAND_QUEUE_SIZE),
+          _wakefd(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)),
+          _commands_dropped(0),
+          _recv_calls(0),
+          _packets_received(0),
+          _lights_superseded(0),
+          _text_unchanged(0),
+          _games(),
+          _games_version(~0ull),
+          _expiry(expiry_tick()) {}
+
+Shard::~Shard() {
+    if (_wakefd >= 0) {
+        close(_wakefd);
+    }
+
+    if (_sockfd >= 0) {
+        close(_sockfd);
+    }
+}
+
+void Shard::wake() {
+    uint64_t one = 1;
+    ssize_t res = write(_wakefd, &one, sizeof(one));
+    (void)res;
+}
+
+class Server::Receiver : public EventLoop::Handler {
+    Server &_server;
+    Shard &_shard;
+    CaptureLog &_capture;
+    uint64_t _count;
+
+public:
+    Receiver(Server &server, Shard &shard, CaptureLog &capture)
+            : _server(server),
+              _shard(shard),
+              _capture(capture),
+              _count(0) {}
+
+    void on_datagram(struct sockaddr_in &address, const char *data, size_t len) override {
+        _count++;
+        _capture.append(address, data, len);
+        _server.handle_data(_shard, address, data, (ssize_t)len);
+    }
+
+    /**
+     * @return how many datagrams have arrived since the last call
+     */
+    uint64_t take_count() {
+        uint64_t count = _count;
+        _count = 0;
+        return count;
+    }
+};
 
 void Server::handle_data(struct sockaddr_in &address, const char *data, ssize_t len) {
     if (len < sizeof(BasePacket)) {
         return;
     }
 
-    switch (reinterpret_cast<const BasePacket*>(data)->type) {
-        case PACKET_TYPE::STATUS: {
-            const Status status = Status::decode_from_packet(reinterpret_cast<const StatusPacket*>(data));
+    handle_data(shard_for((uint64_t)MacAddress(reinterpret_cast<const BasePacket*>(data)->mac.mac)),
+                address, data, len);
+}
 
-            std::cout << status << std::endl;
+void Server::handle_data(Shard &shard, struct sockaddr_in &address, const char *data, ssize_t len) {
+    if (len < 0) {
+        return;
+    }
 
-            auto badge = _badge_ips.find((uint64_t)status.mac_address());
-            if (badge == _badge_ips.end()) {
-                // New badge!
-                auto res = _badge_ips.emplace(
-                        std::piecewise_construct,
-                        std::forward_as_tuple((uint64_t)status.mac_address()),
-                        std::forward_as_tuple(this, (uint64_t)status.mac_address(), address, sizeof(struct sockaddr), "")
-                );
+    PacketDispatch<Server, Shard>::dispatch(*this, shard, address, data, (size_t)len);
+}
 
-                badge = res.first;
+void Server::on_packet(Shard &shard, struct sockaddr_in &address, const StatusView &status) {
+    auto &badges = shard._badges;
+    uint64_t mac = status.mac();
 
-                badge->second.set_lights(0, 5, 0, 0, 5, 0, 0, 5, 0, 0, 5, 0);
+    logger().status(LogLevel::DEBUG, status);
 
-                if (_new_badge_callback) {
-                    _new_badge_callback((uint64_t)status.mac_address());
-                }
-            } else {
-                // We don't want to do this for a new badge, since it has no last update
-                // Check if the badge was rebooted
-                if (status.update_count() < badge->second.last_status().update_count()) {
-                    badge->second.set_lights(0, 5, 0, 0, 5, 0, 0, 5, 0, 0, 5, 0);
-                }
-            }
+    // The wheel's clock only moves on the timer, which is close enough for a timeout and saves a clock read
+    uint64_t lost_at = shard._expiry.now() + (uint64_t)_badge_timeout.count() / EXPIRY_TICK_MS + 1;
 
-            if (_status_callback) {
-                _status_callback(status);
-            }
+    BadgeInfo *badge = badges.find(mac);
+    if (badge == nullptr) {
+        // New badge!
+        badge = badges.insert(mac, this, mac, address);
 
-            if (badge->second.in_game()) {
-                if (badge->second.check_game_quit(status)) {
-                    if (_leave_callback) {
-                        _leave_callback(badge->first, badge->second.current_game()->name());
-                    }
+        if (badge == nullptr) {
+            logger().message(LogLevel::WARN, "Worker %llu badge registry is full", shard.index());
+            return;
+        }
 
-                    badge->second.set_lights(0, 5, 0, 0, 5, 0, 0, 5, 0, 0, 5, 0);
-                    badge->second.set_game(nullptr);
-                }
+        badge->set_lights(0, 5, 0, 0, 5, 0, 0, 5, 0, 0, 5, 0);
 
-                badge->second.set_last_status(std::move(status));
-            } else {
-                badge->second.set_last_status(std::move(status));
-                for (const auto &game : _games) {
-                    if (badge->second.check_game_join(&game)) {
-                        badge->second.set_game(&game);
-
-                        if (_join_callback) {
-                            _join_callback(badge->first, game.name());
-                        }
-                        break;
-                    }
-                }
+        shard._expiry.schedule(badge, lost_at);
+
+        if (_new_badge_callback) {
+            _new_badge_callback(*badge);
+        }
+    } else {
+        // Badges can roam between access points, so keep replies going wherever it last spoke from
+        badge->set_address(address);
+
+        // We don't want to do this for a new badge, since it has no last update
+        // Check if the badge was rebooted
+        if (status.update_count() < badge->update_count()) {
+            badge->forget_screen();
+            badge->set_lights(0, 5, 0, 0, 5, 0, 0, 5, 0, 0, 5, 0);
+        }
+    }
+
+    badge->set_lost_at(lost_at);
+
+    if (_status_callback) {
+        _status_callback(*badge, status);
+    }
+
+    const GameSet &current_games = games(shard);
+
+    uint16_t changed;
+
+    if (badge->in_game()) {
+        if (badge->check_game_quit(status)) {
+            if (_leave_callback) {
+                _leave_callback(mac, badge->current_game(current_games)->name());
             }
 
-            break;
+            badge->set_lights(0, 5, 0, 0, 5, 0, 0, 5, 0, 0, 5, 0);
+            badge->set_game(nullptr);
         }
 
-        case PACKET_TYPE::SCAN: {
-            // TODO Scan packets may be entirely handled by another server
+        changed = badge->set_last_status(status, current_games.matcher());
+    } else {
+        changed = badge->set_last_status(status, current_games.matcher());
 
-            const Scan scan = Scan::decode_from_packet(reinterpret_cast<const ScanPacket*>(data));
-            std::cout << scan << std::endl;
-            auto badge = _badge_ips.find((uint64_t)scan.mac_address());
+        const GameInfo *game = badge->check_game_join(current_games);
+        if (game != nullptr) {
+            badge->set_game(game);
 
-            if (_scan_callback) {
-                _scan_callback(scan);
+            if (_join_callback) {
+                _join_callback(mac, game->name());
             }
+        }
+    }
+
+    // Most packets only move the update count and time, which queues nothing
+    if (_status_change_callback && (changed & STATUS_DELTA_FIELDS) != 0 && badge->queue_status_change()) {
+        shard._status_changes.push_back(badge);
+    }
+}
+
+void Server::on_packet(Shard &shard, struct sockaddr_in &, const ScanView &scan) {
+    // TODO Scan packets may be entirely handled by another server
 
-            if (badge != _badge_ips.end()) {
-                badge->second.on_scan(scan);
+    logger().scan(LogLevel::DEBUG, scan);
+    BadgeInfo *badge = shard._badges.find(scan.mac());
+
+    // Scans are reassembled per badge, so one from a badge we've never had a status from goes nowhere
+    if (badge == nullptr) {
+        return;
+    }
+
+    bool was_pending = badge->scan_pending();
+
+    if (badge->on_scan(scan)) {
+        on_scan_complete(*badge);
+    }
+
+    if (!was_pending && badge->scan_pending()) {
+        shard._pending_scans.push_back(badge);
+    }
+}
+
+void Server::on_malformed(Shard &, struct sockaddr_in &, const char *data, size_t len) {
+    auto base = reinterpret_cast<const BasePacket*>(data);
+    logger().malformed_packet(LogLevel::WARN, (uint64_t)MacAddress(base->mac.mac), base->type, len);
+}
+
+void Server::on_unknown(Shard &, struct sockaddr_in &, const char *data, size_t len) {
+    // should never happen!
+    auto base = reinterpret_cast<const BasePacket*>(data);
+    logger().unknown_packet(LogLevel::WARN, (uint64_t)MacAddress(base->mac.mac), base->type, len);
+}
+
+void Server::expire_scans(Shard &shard) {
+    auto &pending = shard._pending_scans;
+
+    for (BadgeInfo *badge : pending) {
+        if (badge->expire_scan(SCAN_TIMEOUT_MS)) {
+            on_scan_complete(*badge);
+        }
+    }
+
+    pending.erase(std::remove_if(pending.begin(), pending.end(),
+                                 [](BadgeInfo *badge) { return !badge->scan_pending(); }),
+                  pending.end());
+}
+
+void Server::on_scan_complete(BadgeInfo &badge) {
+    const Scan &scan = badge.last_scan();
+
+    if (_scan_callback) {
+        _scan_callback(badge, scan);
+    }
+
+    std::shared_ptr<const FingerprintDb> db = fingerprints();
+    if (db->empty() || scan.stations().empty()) {
+        return;
+    }
+
+    uint16_t location = db->classify(scan, _location_neighbours);
+    if (location != 0 && location != badge.location()) {
+        badge.set_location(location);
+
+        if (_location_callback) {
+            _location_callback(badge, _locations.name(location));
+        }
+    }
+}
+
+void Server::add_fingerprint(const std::string &location, std::vector<std::pair<uint64_t, int8_t>> stations) {
+    uint16_t id = _locations.intern(location);
+    if (id == 0) {
+        throw std::runtime_error("A fingerprint needs a location");
+    }
+
+    std::lock_guard<std::mutex> lock(_fingerprints_mutex);
+
+    std::vector<Fingerprint> samples(_fingerprints->samples());
+    samples.push_back(Fingerprint{id, std::move(stations)});
+
+    std::atomic_store(&_fingerprints, std::shared_ptr<const FingerprintDb>(new FingerprintDb(std::move(samples))));
+}
+
+size_t Server::clear_fingerprints(const std::string &location) {
+    uint16_t id = _locations.find(location);
+
+    std::lock_guard<std::mutex> lock(_fingerprints_mutex);
+
+    std::vector<Fingerprint> samples;
+    if (!location.empty()) {
+        for (const auto &sample : _fingerprints->samples()) {
+            if (sample.location != id) {
+                samples.push_back(sample);
             }
+        }
+    }
 
-            break;
+    size_t removed = _fingerprints->size() - samples.size();
+    std::atomic_store(&_fingerprints, std::shared_ptr<const FingerprintDb>(new FingerprintDb(std::move(samples))));
+
+    return removed;
+}
+
+void Server::publish_status_changes(Shard &shard) {
+    if (shard._status_changes.empty()) {
+        return;
+    }
+
+    auto now = std::chrono::steady_clock::now();
+    if (now - shard._last_status_tick < _status_tick) {
+        return;
+    }
+
+    shard._last_status_tick = now;
+
+    for (BadgeInfo *badge : shard._status_changes) {
+        // Changes that wandered back under the thresholds before the tick aren't reported
+        uint16_t fields = badge->take_status_changes(_status_thresholds);
+        if (fields != 0 && _status_change_callback) {
+            _status_change_callback(*badge, fields, badge->last_status());
         }
+    }
 
-        default:
-            std::cout << "Got UNKNOWN packet!" << std::endl;
-            // should never happen!
-            break;
+    shard._status_changes.clear();
+}
+
+void Server::expire_badges(Shard &shard) {
+    auto &expiry = shard._expiry;
+
+    expiry.advance(expiry_tick(), [&](BadgeInfo *badge) {
+        // Every status pushes the deadline back, but the badge is only moved when its old one comes up
+        if (badge->lost_at() > expiry.now()) {
+            expiry.schedule(badge, badge->lost_at());
+        } else {
+            on_badge_lost(shard, *badge);
+        }
+    });
+}
+
+const GameSet &Server::games(Shard &shard) {
+    // The version is read first, so a set newer than it only means one more reload than needed
+    uint64_t version = _games_version.load(std::memory_order_acquire);
+    if (shard._games_version != version) {
+        shard._games = games();
+        shard._games_version = version;
     }
+
+    return *shard._games;
 }
 
-void Server::run() {
-    socklen_t clientlen = 0;
-    struct sockaddr_in clientaddr{};
-    char buf[BUFSIZE] {};
+void Server::on_badge_lost(Shard &shard, BadgeInfo &badge) {
+    uint64_t mac = badge.mac();
 
-    _running = true;
+    if (badge.in_game()) {
+        const GameInfo *game = badge.current_game(games(shard));
+        if (game != nullptr && _leave_callback) {
+            _leave_callback(mac, game->name());
+        }
+
+        badge.set_game(nullptr);
+    }
+
+    if (_lost_callback) {
+        _lost_callback(badge);
+    }
+
+    // Nothing queued for later may point at the badge once it's gone
+    auto &scans = shard._pending_scans;
+    scans.erase(std::remove(scans.begin(), scans.end(), &badge), scans.end());
+
+    auto &changes = shard._status_changes;
+    changes.erase(std::remove(changes.begin(), changes.end(), &badge), changes.end());
+
+    auto &lights = shard._held_lights;
+    lights.erase(std::remove(lights.begin(), lights.end(), &badge), lights.end());
+
+    shard._badges.erase(mac);
+}
+
+void Server::send_lights(BadgeInfo &badge, const LightData (&lights)[4], uint8_t mask, uint8_t match) {
+    uint32_t interval = (uint32_t)_lights_interval.count();
+
+    if (interval > 0) {
+        uint32_t now = BadgeInfo::now_ms();
+
+        // Anything already waiting has to go first, so newer lights just take its place
+        if (badge.lights_held() || !badge.lights_due(now, interval)) {
+            Shard &shard = shard_for(badge.mac());
+
+            if (badge.hold_lights(lights, mask, match)) {
+                shard._held_lights.push_back(&badge);
+            } else {
+                shard._lights_superseded++;
+            }
+            return;
+        }
+
+        badge.set_lights_sent(now);
+    }
+
+    send<LIGHTS>(badge, lights, mask, match);
+}
+
+void Server::flush_lights(Shard &shard) {
+    auto &held = shard._held_lights;
+    if (held.empty()) {
+        return;
+    }
 
+    uint32_t interval = (uint32_t)_lights_interval.count();
+    uint32_t now = BadgeInfo::now_ms();
+
+    held.erase(std::remove_if(held.begin(), held.end(), [&](BadgeInfo *badge) {
+        if (!badge->lights_due(now, interval)) {
+            return false;
+        }
+
+        badge->send_held_lights(now);
+        return true;
+    }), held.end());
+}
+
+int Server::open_socket(bool reuse_port) {
     /*
      * socket: create the parent socket
      */
-    _sockfd = socket(AF_INET, SOCK_DGRAM, 0);
-    if (_sockfd < 0) {
+    int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sockfd < 0) {
         std::cerr << "ERROR opening socket" << std::endl;
-        return;
+        return -1;
     }
 
     // Lets multiple apps bind to the same address simultaneously
     int optval = 1;
-    setsockopt(_sockfd, SOL_SOCKET, SO_REUSEADDR,
+    setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR,
                (const void *) &optval, sizeof(int));
 
+    // Lets each worker bind its own socket to the port, so the kernel can spread datagrams between them
+    if (reuse_port) {
+        setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT,
+                   (const void *) &optval, sizeof(int));
+    }
+
     struct sockaddr_in serveraddr{};
     serveraddr.sin_family = AF_INET;
     serveraddr.sin_addr.s_addr = htonl(INADDR_ANY);
     serveraddr.sin_port = htons((unsigned short) PORT);
 
-    if (bind(_sockfd, (struct sockaddr *) &serveraddr,
+    if (bind(sockfd, (struct sockaddr *) &serveraddr,
              sizeof(serveraddr)) < 0) {
         std::cerr << "ERROR on binding" << std::endl;
     }
 
+    return sockfd;
+}
+
+bool Server::attach_steering(int sockfd) {
+    /*
+     * The kernel runs this against the UDP payload of every datagram and delivers it to the socket
+     * at the returned index in the reuseport group, i.e. the order the workers were bound in.
+     * Every packet starts with the badge MAC, so bytes 2-5 are its low 32 bits.
+     */
+    struct sock_filter code[] = {
+            {BPF_LD | BPF_W | BPF_ABS,   0, 0, 2},
+            {BPF_ALU | BPF_MOD | BPF_K,  0, 0, (uint32_t)_shards.size()},
+            {BPF_RET | BPF_A,            0, 0, 0},
+    };
+
+    struct sock_fprog prog{};
+    prog.len = sizeof(code) / sizeof(code[0]);
+    prog.filter = code;
+
+    return setsockopt(sockfd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) == 0;
+}
+
+bool Server::open() {
+    if (_shards.back()->_sockfd >= 0) {
+        return true;
+    }
+
+    bool reuse_port = _shards.size() > 1;
+
+    // All the sockets have to be bound in shard order before the steering program can index them
+    for (auto &shard : _shards) {
+        shard->_sockfd = open_socket(reuse_port);
+        if (shard->_sockfd < 0) {
+            return false;
+        }
+    }
+
+    if (reuse_port && !attach_steering(_shards[0]->_sockfd)) {
+        std::cerr << "ERROR attaching reuseport steering program, falling back to one worker" << std::endl;
+
+        _shards.resize(1);
+    }
+
+    return true;
+}
+
+bool Server::run() {
+    if (!open()) {
+        return false;
+    }
+
+    _running = true;
+
+    // A worker that can't start stops the rest, rather than leave its badges unserved
+    std::atomic<bool> failed(false);
+    std::vector<std::thread> workers;
+    for (size_t i = 1; i < _shards.size(); i++) {
+        workers.emplace_back([this, i, &failed]() {
+            if (!run_worker(*_shards[i])) {
+                failed = true;
+                stop();
+            }
+        });
+    }
+
+    if (!run_worker(*_shards[0])) {
+        failed = true;
+        stop();
+    }
+
+    for (auto &worker : workers) {
+        worker.join();
+    }
+
+    _running = false;
+    return !failed;
+}
+
+uint64_t Server::replay(const std::vector<std::string> &paths, bool realtime) {
+    std::vector<CaptureReader> captures;
+    for (const auto &path : paths) {
+        CaptureReader capture;
+        if (!capture.open(path)) {
+            std::cerr << "ERROR reading capture file " << path << std::endl;
+            return 0;
+        }
+
+        captures.push_back(std::move(capture));
+    }
+
+    _running = true;
+
+    // There is no socket, so replies are only counted
+    SendQueue queue(-1, _batch_size);
+    SendQueue::Scope scope(queue);
+
+    auto interval = timer_interval();
+    auto start = std::chrono::steady_clock::now();
+    auto next_tick = start + interval;
+
+    auto tick = [&]() {
+        for (auto &shard : _shards) {
+            run_timers(*shard);
+            flush_lights(*shard);
+        }
+
+        next_tick = std::chrono::steady_clock::now() + interval;
+    };
+
+    uint64_t first_ns = 0;
+    uint64_t replayed = 0;
+
+    while (!_stopping) {
+        // Each worker captured its own share, so merge them back into the order they arrived in
+        CaptureReader *earliest = nullptr;
+        for (auto &capture : captures) {
+            const CaptureRecord *record = capture.peek();
+            if (record != nullptr && (earliest == nullptr || record->time_ns < earliest->peek()->time_ns)) {
+                earliest = &capture;
+            }
+        }
 
-    ssize_t count;
-    while (_running) {
-        count = recvfrom(_sockfd, buf, BUFSIZE, 0,
-                     (struct sockaddr *) &clientaddr, &clientlen);
-        if (count < 0) {
-            std::cerr << "ERROR in recvfrom" << std::endl;
+        if (earliest == nullptr) {
             break;
         }
 
-        /*
-         * gethostbyaddr: determine who sent the datagram
-         */
-        char addr[NI_MAXHOST] {}, serv[NI_MAXSERV] {};
-        if (!getnameinfo((sockaddr*) &clientaddr, clientlen,
-                    addr, sizeof(addr),
-                    serv, sizeof(serv),
-                    NI_NUMERICHOST | NI_NUMERICSERV)) {
+        const CaptureRecord *record = earliest->peek();
+        if (first_ns == 0) {
+            first_ns = record->time_ns;
+        }
 
-            handle_data(clientaddr, buf, count);
-        } else {
-            std::cerr << "ERR? " << gai_strerror(errno) << "(" << errno << ")" << std::endl;
+        if (realtime && record->time_ns > first_ns) {
+            auto due = start + std::chrono::nanoseconds(record->time_ns - first_ns);
+            for (auto now = std::chrono::steady_clock::now(); now < due && !_stopping;
+                 now = std::chrono::steady_clock::now()) {
+                std::this_thread::sleep_until(std::min(due, next_tick));
+                if (std::chrono::steady_clock::now() >= next_tick) {
+                    tick();
+                }
+            }
+        }
+
+        struct sockaddr_in address{};
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = record->ip;
+        address.sin_port = record->port;
+
+        handle_data(address, record->data(), record->len);
+        earliest->next();
+
+        // Reading the clock for every datagram would show up when going flat out
+        if (++replayed % 256 == 0 && std::chrono::steady_clock::now() >= next_tick) {
+            tick();
         }
     }
+
+    tick();
+
+    _running = false;
+    return replayed;
 }
 
-void Server::send_packet(BadgeInfo *badge, const char *packet, size_t packet_len) {
-    assert(_running);
+void Server::stop() {
+    _stopping = true;
 
-    sendto(_sockfd, packet, packet_len,
-           0,
-           (struct sockaddr*)&badge->sock_address(),
-           badge->sock_address_len());
+    for (auto &shard : _shards) {
+        shard->wake();
+    }
+}
+
+std::chrono::milliseconds Server::timer_interval() const {
+    // Scans time out, status changes go out and held lights are released on this tick, so it has to be at
+    // least as fine as all of them
+    auto interval = std::min(_status_tick, std::chrono::milliseconds(SCAN_TIMEOUT_MS / 2));
+    if (_lights_interval.count() > 0) {
+        interval = std::min(interval, _lights_interval);
+    }
+
+    return interval;
+}
+
+void Server::run_timers(Shard &shard) {
+    expire_scans(shard);
+    publish_status_changes(shard);
+    expire_badges(shard);
+}
+
+bool Server::run_worker(Shard &shard) {
+    auto loop = EventLoop::create(_event_loop, shard._sockfd, shard._wakefd, timer_interval(), _batch_size,
+                                  BUFSIZE);
+    if (!loop) {
+        logger().message(LogLevel::ERROR, "Worker %llu: the event loop backend can't be used here", shard.index());
+        return false;
+    }
+
+    logger().message(LogLevel::INFO, strcmp(loop->name(), "io_uring") == 0
+                                     ? "Worker %llu waiting with io_uring"
+                                     : "Worker %llu waiting with epoll", shard.index());
+
+    // Anything a wakeup makes us send goes out in one go once it has been handled
+    SendQueue queue(shard._sockfd, _batch_size);
+    SendQueue::Scope scope(queue);
+
+    CaptureLog capture;
+    if (!_capture_path.empty() && !capture.open(_capture_path + "." + std::to_string(shard.index()))) {
+        logger().message(LogLevel::ERROR, "Worker %llu can't open its capture file, not capturing", shard.index());
+    }
+
+    Receiver receiver(*this, shard, capture);
+    auto last_stats = std::chrono::steady_clock::now();
+
+    while (!_stopping) {
+        uint32_t events = loop->wait(receiver);
+
+        if (events & EventLoop::WAKE) {
+            run_commands(shard);
+        }
+
+        if (events & EventLoop::TIMER) {
+            run_timers(shard);
+        }
+
+        flush_lights(shard);
+        queue.flush();
+
+        uint64_t calls = ++shard._recv_calls;
+        uint64_t packets = shard._packets_received += receiver.take_count();
+
+        auto now = std::chrono::steady_clock::now();
+        if ((events & EventLoop::TIMER) && now - last_stats >= std::chrono::milliseconds(STATS_INTERVAL_MS)) {
+            last_stats = now;
+
+            logger().message(LogLevel::INFO, "Worker %llu received %llu packets in %llu wakeups",
+                             shard.index(), packets, calls);
+            logger().message(LogLevel::INFO, "Worker %llu sent %llu packets in %llu calls",
+                             shard.index(), queue.packets_sent(), queue.send_calls());
+            logger().message(LogLevel::INFO, "Worker %llu dropped %llu lights packets that were replaced in time",
+                             shard.index(), shard._lights_superseded);
+            logger().message(LogLevel::INFO, "Worker %llu skipped %llu text packets the screen was already showing",
+                             shard.index(), shard._text_unchanged);
+        }
+    }
+
+    return true;
+}
+
+void Server::send_packet(BadgeInfo *badge, const char *packet, size_t packet_len) {
+    send_packet(*badge, packet, packet_len);
 }
 
 void Server::send_packet(BadgeInfo &badge, const char *packet, size_t packet_len) {
     assert(_running);
 
-    sendto(_sockfd, packet, packet_len,
+    struct sockaddr_in address = badge.sock_address();
+
+    SendQueue *queue = SendQueue::current();
+    if (queue != nullptr) {
+        queue->push(address, packet, packet_len);
+        return;
+    }
+
+    sendto(shard_for(badge.mac())._sockfd, packet, packet_len,
            0,
-           (struct sockaddr*)&badge.sock_address(),
+           (struct sockaddr*)&address,
            badge.sock_address_len());
 }
 
 void Server::send_packet(MacAddress &mac, const char *packet, size_t packet_len) {
+    send_packet((uint64_t)mac, packet, packet_len);
+}
+
+void Server::send_packet(uint64_t mac, const char *packet, size_t packet_len) {
     assert(_running);
 
-    auto badge = _badge_ips.find((uint64_t)mac);
-    if (badge != _badge_ips.end()) {
-        send_packet(badge->second, packet, packet_len);
+    auto badge = find_badge(mac);
+    if (badge != nullptr) {
+        send_packet(*badge, packet, packet_len);
     }
 }
 
-void Server::send_packet(uint64_t mac, const char *packet, size_t packet_len) {
-    assert(_running);
+bool Server::post(Shard &shard, const Command &command) {
+    if (!shard._commands.try_push(command)) {
+        uint64_t dropped = ++shard._commands_dropped;
+        logger().message(LogLevel::WARN, "Worker %llu command queue is full, %llu commands dropped",
+                         shard.index(), dropped);
+        return false;
+    }
+
+    shard.wake();
 
-    auto badge = _badge_ips.find(mac);
-    if (badge != _badge_ips.end()) {
-        send_packet(badge->second, packet, packet_len);
+    return true;
+}
+
+bool Server::set_lights(uint64_t mac, const LightData (&lights)[4], uint8_t mask, uint8_t match) {
+    Command command{};
+    command.kind = CommandKind::LIGHTS;
+    command.mac = mac;
+    memcpy(command.lights.lights, lights, sizeof(command.lights.lights));
+    command.lights.mask = mask;
+    command.lights.match = match;
+
+    return post(shard_for(mac), command);
+}
+
+bool Server::set_text(uint64_t mac, uint8_t x, uint8_t y, uint8_t style, const std::string &text) {
+    Command command{};
+    command.kind = CommandKind::TEXT;
+    command.mac = mac;
+    command.text.x = x;
+    command.text.y = y;
+    command.text.style = style;
+    command.text.len = (uint8_t)std::min(text.size(), Command::MAX_TEXT);
+    memcpy(command.text.text, text.data(), command.text.len);
+
+    return post(shard_for(mac), command);
+}
+
+bool Server::set_screen(uint64_t mac, const std::vector<ScreenLine> &lines) {
+    Command command{};
+    command.kind = CommandKind::SCREEN;
+    command.mac = mac;
+
+    size_t size = 0;
+    for (const auto &line : lines) {
+        size_t len = std::min(line.text.size(), Command::MAX_TEXT);
+        if (size + 4 + len > sizeof(command.screen.lines)) {
+            return false;
+        }
+
+        char *out = command.screen.lines + size;
+        out[0] = (char)line.x;
+        out[1] = (char)line.y;
+        out[2] = (char)line.style;
+        out[3] = (char)len;
+        memcpy(out + 4, line.text.data(), len);
+        size += 4 + len;
     }
+
+    command.screen.count = (uint8_t)lines.size();
+    command.screen.size = (uint8_t)size;
+
+    return post(shard_for(mac), command);
 }
 
-BadgeInfo *Server::find_badge(uint64_t mac) {
-    auto badge = _badge_ips.find(mac);
-    if (badge != _badge_ips.end()) {
-        return &badge->second;
+bool Server::request_scan(uint64_t mac) {
+    Command command{};
+    command.kind = CommandKind::SCAN;
+    command.mac = mac;
+
+    return post(shard_for(mac), command);
+}
+
+bool Server::kick(uint64_t mac) {
+    Command command{};
+    command.kind = CommandKind::KICK;
+    command.mac = mac;
+
+    return post(shard_for(mac), command);
+}
+
+size_t Server::set_game_lights(const std::string &game_name, const LightData (&lights)[4],
+                               uint8_t mask, uint8_t match) {
+    auto current_games = games();
+    const GameInfo *game = current_games->find(game_name);
+    if (game == nullptr) {
+        return 0;
+    }
+
+    Command command{};
+    command.kind = CommandKind::GAME_LIGHTS;
+    command.game_lights.game_id = game->id();
+    memcpy(command.game_lights.lights, lights, sizeof(command.game_lights.lights));
+    command.game_lights.mask = mask;
+    command.game_lights.match = match;
+
+    size_t players = 0;
+    for (auto &shard : _shards) {
+        // A worker whose queue is full won't send to its players, so they don't count
+        if (!post(*shard, command)) {
+            continue;
+        }
+
+        shard->_badges.for_each([&](const BadgeInfo &badge) {
+            players += badge.game_id() == game->id();
+        });
+    }
+
+    return players;
+}
+
+void Server::run_commands(Shard &shard) {
+    Command command;
+    while (shard._commands.try_pop(command)) {
+        run_command(shard, command);
+    }
+}
+
+void Server::run_command(Shard &shard, const Command &command) {
+    if (command.kind == CommandKind::GAME_LIGHTS) {
+        shard._badges.for_each([&](BadgeInfo &badge) {
+            if (badge.game_id() == command.game_lights.game_id) {
+                badge.set_lights(command.game_lights.lights, command.game_lights.mask, command.game_lights.match);
+            }
+        });
+        return;
+    }
+
+    BadgeInfo *badge = shard._badges.find(command.mac);
+    if (badge == nullptr) {
+        return;
     }
 
-    return nullptr;
-}
\ No newline at end of file
+    switch (command.kind) {
+        case CommandKind::LIGHTS:
+            badge->set_lights(command.lights.lights, command.lights.mask, command.lights.match);
+            break;
+
+        case CommandKind::TEXT:
+            if (!badge->set_text(command.text.x, command.text.y, command.text.style,
+                                 std::string(command.text.text, command.text.len))) {
+                shard._text_unchanged++;
+            }
+            break;
+
+        case CommandKind::SCREEN: {
+            std::vector<ScreenLine> lines;
+            const char *in = command.screen.lines;
+            for (uint8_t i = 0; i < command.screen.count; i++) {
+                lines.push_back(ScreenLine{(uint8_t)in[0], (uint8_t)in[1], (uint8_t)in[2],
+                                           std::string(in + 4, (uint8_t)in[3])});
+                in += 4 + (uint8_t)in[3];
+            }
+
+            shard._text_unchanged += badge->set_screen(lines);
+            break;
+        }
+
+        case CommandKind::SCAN:
+            badge->scan();
+            break;
+
+        case CommandKind::KICK: {
+            static const LightData OFF[4] {};
+
+            // Reported the same way as a badge that times out
+            if (badge->in_game()) {
+                const GameInfo *game = badge->current_game(games(shard));
+                if (game != nullptr && _leave_callback) {
+                    _leave_callback(command.mac, game->name());
+                }
+            }
+
+            badge->set_game(nullptr);
+            badge->set_lights(OFF);
+            break;
+        }
+
+        default:
+            break;
+    }
+}
+
+BadgeInfo *Server::find_badge(uint64_t mac) {
+    return shard_for(mac)._badges.find(mac);
+}
@@ -2,267 +2,504 @@
 #define SERVER_H
 
 #include <netinet/in.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
 #include <functional>
 #include <unordered_map>
 #include <stdexcept>
 #include <iostream>
 #include <chrono>
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <utility>
 
 #include "packets.h"
+#include "registry.h"
+#include "games.h"
+#include "codec.h"
+#include "fingerprints.h"
+#include "commands.h"
+#include "ring.h"
+#include "timing_wheel.h"
+#include "send_queue.h"
+#include "event_loop.h"
 
 class Server;
 
-class GameInfo {
-    std::string _name;
-    std::string _sequence;
-    std::string _location;
+/**
+ * The last few buttons a badge released, packed four bits each into a single word with the newest
+ * in the lowest bits.
+ */
+template<int len = 16>
+class ButtonHistory {
+    static_assert(len > 0 && len <= 16, "ButtonHistory holds at most 16 buttons");
 
-public:
-    GameInfo(const std::string name, const std::string &sequence = "", const std::string &location = "")
-            : _name(std::move(name)),
-              _sequence(sequence),
-              _location(location) {}
+    uint64_t _values;
 
-    const std::string &name() const {
-        return _name;
+    static uint64_t mask(int count) {
+        return count >= 16 ? ~0ull : (1ull << (4 * count)) - 1;
     }
 
-    bool use_sequence() const {
-        return !_sequence.empty();
-    }
+public:
+    ButtonHistory()
+            : _values(0) {}
 
-    bool use_location() const {
-        return !_location.empty();
+    void record(BUTTON b) {
+        _values = ((_values << 4) | ((uint64_t)b & 0xf)) & mask(len);
     }
 
-    const std::string &sequence() const {
-        return _sequence;
+    /**
+     * @param age 0 for the most recent button
+     * @return
+     */
+    static int capacity() {
+        return len;
     }
 
-    void set_sequence(const std::string sequence) {
-        _sequence = sequence;
+    BUTTON at(int age) const {
+        return (BUTTON)((_values >> (4 * age)) & 0xf);
     }
 
-    const std::string &location() const {
-        return _location;
-    }
+    /**
+     * Packs a join code the same way the history is stored, oldest button first
+     * @param seq
+     * @param packed
+     * @param count
+     * @return false if the sequence is empty, too long to ever match or not made of buttons
+     */
+    static bool pack(const char *seq, uint64_t &packed, int &count) {
+        packed = 0;
+        count = 0;
 
-    void set_location(const std::string location) {
-        _location = location;
-    }
-};
+        for (; *seq != '\0'; seq++, count++) {
+            BUTTON b = button_from_char(*seq);
+            if (b == BUTTON::NONE || count >= len) {
+                return false;
+            }
 
-template<int len = 16>
-class ButtonHistory {
-    BUTTON _values[len];
-    BUTTON *_cur, *_end;
+            packed = (packed << 4) | (uint64_t)b;
+        }
 
-public:
-    ButtonHistory()
-            : _values{BUTTON::NONE} {
-        _cur = _values;
-        _end = _values + len;
+        return count > 0;
     }
 
-    void record(BUTTON b) {
-        *(_cur++) = b;
-        if (_cur >= _end) _cur = _values;
+    /**
+     * Matches the join code in any position
+     * @param seq
+     * @return
+     */
+    bool match_any(const char *seq) const {
+        uint64_t packed;
+        int count;
+        if (!pack(seq, packed, count)) {
+            return false;
+        }
+
+        for (int offset = 0; offset + count <= len; offset++) {
+            if (((_values >> (4 * offset)) & mask(count)) == packed) {
+                return true;
+            }
+        }
+
+        return false;
     }
 
     /**
-     * Matches the join code in any position
+     * Matches the join code in the last position
      * @param seq
      * @return
      */
-    bool match_any(const char *seq) {
-        // Start the pointer into the sequence at one past the last one we inserted
-        const BUTTON *cmp = _cur;
+    bool match(const char *seq) const {
+        uint64_t packed;
+        int count;
+        return pack(seq, packed, count) && (_values & mask(count)) == packed;
+    }
+};
 
-        // start the pointer into the check-sequence at the last one
-        const char *seq_start = seq + strlen(seq) - 1;
+/**
+ * A line of text as it was last written to a badge's screen
+ */
+struct ScreenLine {
+    uint8_t x;
+    uint8_t y;
+    uint8_t style;
+    std::string text;
+
+    bool at(uint8_t line_x, uint8_t line_y, uint8_t line_style) const {
+        return x == line_x && y == line_y && style == line_style;
+    }
+};
 
-        // the pointer we will use to compare
-        const char *idx = seq_start;
+/**
+ * Per-badge state that is only needed now and then. It lives out of line so that the records the packet
+ * path walks stay small.
+ */
+struct BadgeCold {
+    // Truncated steady clock milliseconds, only ever compared by difference
+    uint32_t last_start_down;
+    Status last_status;
+    std::string host;
+
+    // The newest complete scan, and the one still arriving in fragments
+    Scan last_scan;
+    Scan pending_scan;
+    bool scan_pending;
+    uint32_t scan_updated;
+
+    // What the status change stream last reported, and whether the badge is waiting for the next tick
+    Status published_status;
+    bool status_queued;
+
+    // Belongs to whoever handles the server's callbacks
+    std::shared_ptr<void> user_data;
+
+    // The expiry tick at which the badge is lost if it hasn't sent a status since
+    uint64_t lost_at;
+
+    // Lights held back by the rate cap, replaced by anything newer, and when lights last went out
+    LightData held_lights[4];
+    uint8_t held_mask;
+    uint8_t held_match;
+    bool lights_held;
+    uint32_t lights_sent;
+
+    // What the screen should be showing, by where each line was written; forgotten when the badge reboots
+    std::vector<ScreenLine> screen;
+};
 
-        const BUTTON *match_start = nullptr;
+/**
+ * The per-badge state touched by every packet. These sit back to back in the registry, and anything
+ * bulky goes in the BadgeCold record beside it.
+ */
+class BadgeInfo {
+    Server *_server;
+    BadgeCold *_cold;
 
-        for(;;) {
-            // Move to the previous button that was pressed
-            cmp--;
+    uint64_t _mac;
 
-            // wrap around if we end up before the beginning
-            if (cmp < _values) cmp = _end-1;
+    // Where the badge last sent from, both in network order
+    uint32_t _ip;
+    uint16_t _port;
 
-            // compare the buffer to the sequence, and move to the previous character if successful
-            if (button_char(*cmp) == *idx) {
-                // Keep track of the first position where we matched a character, because we need to backtrack
-                // to the one after this if we fail in the middle
-                if (match_start == nullptr) {
-                    match_start = cmp;
-                }
+    uint16_t _update_count;
+    ButtonHistory<12> _history;
 
-                idx--;
-            } else {
-                // Move back to the end of the sequence to start checking again
-                idx = seq_start;
+    // 0 when not in a game. Also read by WAMP handlers on other threads
+    std::atomic<uint16_t> _game_id;
 
-                // Backtrack to where we last succeeded and try the next one
-                if (match_start != nullptr) {
-                    cmp = match_start;
-                    match_start = nullptr;
-                }
-            }
+    // Where the badge is in the join automaton, and which build of it that state belongs to
+    JoinMatcher::State _join_state;
+    uint16_t _join_version;
 
-            // If we get all the way to the start of the sequence, then we've checked everywhere (successfully)
-            if (idx < seq) {
-                return true;
+    // From the server's LocationTable, 0 when unknown
+    uint16_t _location;
+
+    /**
+     * Catches the join state up after the automaton is rebuilt by feeding it the remembered buttons
+     */
+    void sync_join_state(const JoinMatcher &matcher) {
+        _join_state = matcher.start();
+        for (int age = _history.capacity() - 1; age >= 0; age--) {
+            BUTTON b = _history.at(age);
+            if (b != BUTTON::NONE) {
+                _join_state = matcher.advance(_join_state, b);
             }
+        }
 
+        _join_version = matcher.version();
+    }
 
-            // If we get back to where we started, then we've checked everywhere (unsuccessfully)
-            if (cmp == _cur) {
-                return false;
-            }
+    void complete_scan() {
+        std::swap(_cold->last_scan, _cold->pending_scan);
+        _cold->scan_pending = false;
+    }
+
+public:
+    // Truncated steady clock milliseconds, as kept in the cold record
+    static uint32_t now_ms() {
+        using namespace std::chrono;
+        return (uint32_t)duration_cast<milliseconds>(steady_clock::now().time_since_epoch()).count();
+    }
+
+    BadgeInfo(BadgeCold *cold,
+              Server *server,
+              uint64_t mac,
+              const struct sockaddr_in &sockaddr)
+            : _server(server),
+              _cold(cold),
+              _mac(mac),
+              _ip(sockaddr.sin_addr.s_addr),
+              _port(sockaddr.sin_port),
+              _update_count(0),
+              _history(),
+              _game_id(0),
+              _join_state(0),
+              _join_version(0),
+              _location(0) {
+        _cold->last_start_down = 0;
+        _cold->scan_pending = false;
+        _cold->scan_updated = 0;
+        _cold->status_queued = false;
+    }
+
+    struct sockaddr_in sock_address() const {
+        struct sockaddr_in address{};
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = _ip;
+        address.sin_port = _port;
+        return address;
+    }
+
+    socklen_t sock_address_len() const { return sizeof(struct sockaddr_in); }
+
+    /**
+     * Updates the cached endpoint if the badge is now sending from somewhere else
+     * @param address
+     * @return whether the endpoint changed
+     */
+    bool set_address(const struct sockaddr_in &address) {
+        if (address.sin_addr.s_addr == _ip && address.sin_port == _port) {
+            return false;
         }
+
+        _ip = address.sin_addr.s_addr;
+        _port = address.sin_port;
+        _cold->host.clear();
+
+        return true;
     }
 
     /**
-     * Matches the join code in the last position
-     * @param seq
-     * @return
+     * The numeric host of the badge, only formatted when somebody asks for it
      */
-    bool match(const char *seq) {
-        // Start the pointer into the sequence at one past the last one we inserted
-        const BUTTON *cmp = _cur;
+    const std::string &host() {
+        if (_cold->host.empty()) {
+            char addr[INET_ADDRSTRLEN] {};
+            if (inet_ntop(AF_INET, &_ip, addr, sizeof(addr)) != nullptr) {
+                _cold->host = addr;
+            }
+        }
 
-        // start the pointer into the check-sequence at the last one
-        const char *seq_start = seq + strlen(seq) - 1;
+        return _cold->host;
+    }
 
-        // the pointer we will use to compare
-        const char *idx = seq_start;
+    Status &last_status() { return _cold->last_status; }
 
-        for(;;) {
-            // Move to the previous button that was pressed
-            cmp--;
+    uint16_t update_count() const { return _update_count; }
 
-            // wrap around if we end up before the beginning
-            if (cmp < _values) cmp = _end-1;
+    /**
+     * @param status
+     * @param matcher the join automaton to advance with any button that was released
+     * @return the STATUS_FIELD bits that differ from the previous status
+     */
+    uint16_t set_last_status(const StatusView &status, const JoinMatcher &matcher) {
+        uint16_t changed = _cold->last_status.update(status);
+        _update_count = status.update_count();
 
-            // compare the buffer to the sequence, and move to the previous character if successful
-            if (button_char(*cmp) == *idx) {
-                idx--;
-            } else {
-                return false;
-            }
+        bool released = status.last_button() != BUTTON::NONE && !status.button_down();
+        if (released) {
+            _history.record(status.last_button());
+        }
 
-            // If we get all the way to the start of the sequence, then we've checked everywhere (successfully)
-            if (idx < seq) {
-                return true;
-            }
+        if (_join_version != matcher.version()) {
+            sync_join_state(matcher);
+        } else if (released) {
+            _join_state = matcher.advance(_join_state, status.last_button());
+        }
 
+        return changed;
+    }
 
-            // If we get back to where we started, then the sequence is too long.
-            if (cmp == _cur) {
-                return false;
-            }
+    /**
+     * Marks the badge as having a status change to report at the next tick
+     * @return false if it was already waiting
+     */
+    bool queue_status_change() {
+        if (_cold->status_queued) {
+            return false;
         }
+
+        _cold->status_queued = true;
+        return true;
     }
-};
 
-class BadgeInfo {
-    Server *_server;
+    /**
+     * Takes the fields that have changed enough since they were last reported, and counts them as reported
+     * @param thresholds
+     * @return STATUS_FIELD bits
+     */
+    uint16_t take_status_changes(const StatusThresholds &thresholds) {
+        uint16_t fields = _cold->last_status.changes(_cold->published_status, thresholds);
+        _cold->published_status.apply(_cold->last_status, fields);
+        _cold->status_queued = false;
+        return fields;
+    }
 
-    uint64_t _mac;
+    uint64_t station() { return (uint64_t)_cold->last_status.bssid(); }
 
-    struct sockaddr_in _sockaddr;
-    socklen_t _sockaddr_len;
+    /**
+     * Somewhere for the code handling the server's callbacks to keep its own per-badge state, built once
+     * when the badge is first seen. Only the badge's worker should touch it, i.e. from inside those callbacks.
+     */
+    void *user_data() const {
+        return _cold->user_data.get();
+    }
 
-    std::string _host;
+    void set_user_data(std::shared_ptr<void> data) {
+        _cold->user_data = std::move(data);
+    }
 
-    Status _last_status;
-    uint64_t _station;
+    bool lights_held() const {
+        return _cold->lights_held;
+    }
 
-    std::string _location;
-    Scan _last_scan;
-    ButtonHistory<12> _history;
-    const GameInfo *_game;
-    std::chrono::time_point<std::chrono::system_clock> _last_start_down;
+    /**
+     * Keeps lights back until the rate cap allows them, replacing any that were already waiting
+     * @param lights
+     * @param mask
+     * @param match
+     * @return true if none were waiting before
+     */
+    bool hold_lights(const LightData (&lights)[4], uint8_t mask, uint8_t match) {
+        bool first = !_cold->lights_held;
 
-public:
-    BadgeInfo(Server *server,
-              uint64_t mac,
-              struct sockaddr_in &sockaddr,
-              socklen_t sockaddr_len,
-              const std::string &host,
-              uint64_t station = 0)
-            : _server(server),
-              _mac(mac),
-              _sockaddr(sockaddr),
-              _sockaddr_len(sockaddr_len),
-              _host(host),
-              _last_status(),
-              _station(station),
-              _location(),
-              _last_scan(),
-              _history(),
-              _game(nullptr) {}
+        memcpy(_cold->held_lights, lights, sizeof(_cold->held_lights));
+        _cold->held_mask = mask;
+        _cold->held_match = match;
+        _cold->lights_held = true;
 
-    struct sockaddr_in &sock_address() { return _sockaddr; }
-    socklen_t sock_address_len() { return _sockaddr_len; }
+        return first;
+    }
 
-    void set_address(struct sockaddr_in address, socklen_t len) {
-        _sockaddr = address;
-        _sockaddr_len = len;
+    /**
+     * @param now_ms
+     * @param interval_ms the least time allowed between two lights packets
+     * @return whether lights may go out now
+     */
+    bool lights_due(uint32_t now_ms, uint32_t interval_ms) const {
+        return now_ms - _cold->lights_sent >= interval_ms;
     }
 
-    const std::string &host() { return _host; }
+    void set_lights_sent(uint32_t now_ms) {
+        _cold->lights_sent = now_ms;
+    }
 
-    Status &last_status() { return _last_status; }
+    /**
+     * Sends the lights that were held back
+     * @param now_ms
+     */
+    void send_held_lights(uint32_t now_ms);
 
-    void set_last_status(const Status &&status) {
-        _last_status = status;
+    uint64_t lost_at() const {
+        return _cold->lost_at;
+    }
 
-        _station = (uint64_t)status.bssid();
+    void set_lost_at(uint64_t tick) {
+        _cold->lost_at = tick;
+    }
 
-        if (_last_status.last_button() != BUTTON::NONE && !_last_status.button_down()) {
-            _history.record(_last_status.last_button());
+    /**
+     * Adds a fragment to the scan being reassembled. A fragment with a new timestamp completes the scan
+     * before it, and fragments of a scan that was already completed are ignored.
+     * @param scan
+     * @return true if a scan was completed and is now last_scan()
+     */
+    bool on_scan(const ScanView &scan) {
+        BadgeCold &cold = *_cold;
+        bool completed = false;
+
+        if (cold.scan_pending && !cold.pending_scan.same_scan(scan)) {
+            complete_scan();
+            completed = true;
         }
+
+        if (!cold.scan_pending) {
+            if (cold.last_scan.same_scan(scan)) {
+                return completed;
+            }
+
+            cold.scan_pending = true;
+        }
+
+        cold.pending_scan.update(scan);
+        cold.scan_updated = now_ms();
+
+        return completed;
     }
 
-    uint64_t station() { return _station; }
+    bool scan_pending() const {
+        return _cold->scan_pending;
+    }
 
-    void on_scan(const Scan &scan) {
-        if (!_last_scan.update(scan)) {
-            _last_scan = scan;
+    /**
+     * Completes the scan being reassembled if no fragment has arrived for a while
+     * @param timeout_ms
+     * @return true if a scan was completed and is now last_scan()
+     */
+    bool expire_scan(uint32_t timeout_ms) {
+        if (!_cold->scan_pending || now_ms() - _cold->scan_updated < timeout_ms) {
+            return false;
         }
+
+        complete_scan();
+        return true;
     }
 
     const Scan &last_scan() {
-        return _last_scan;
+        return _cold->last_scan;
     }
 
     bool in_game() const {
-        return _game != nullptr;
+        return _game_id != 0;
     }
 
-    const GameInfo *current_game() const {
-        return _game;
+    uint16_t game_id() const {
+        return _game_id;
     }
 
-    bool check_game_join(const GameInfo *game) {
-        return (game->use_sequence() && _history.match(game->sequence().c_str()))
-                || (game->use_location() && _location == game->location());
+    /**
+     * @param games a snapshot the caller holds for as long as it uses the result
+     * @return the badge's game, or nullptr when not in one
+     */
+    const GameInfo *current_game(const GameSet &games) const {
+        return games.game(_game_id);
+    }
+
+    uint16_t location() const {
+        return _location;
     }
 
-    bool check_game_quit(const Status &status) {
+    void set_location(uint16_t location) {
+        _location = location;
+    }
+
+    /**
+     * Must come after set_last_status() with the same set's matcher
+     * @param games
+     * @return the game the badge should join, or nullptr
+     */
+    const GameInfo *check_game_join(const GameSet &games) const {
+        uint16_t id = games.matcher().match(_join_state);
+
+        // Like the sequence, the game registered first wins if both apply
+        const GameInfo *located = games.at_location(_location);
+        if (located != nullptr && (id == 0 || located->id() < id)) {
+            return located;
+        }
+
+        return games.game(id);
+    }
+
+    bool check_game_quit(const StatusView &status) {
         if (status.last_button() == BUTTON::START) {
             if (status.button_down()) {
                 // This button press is the player pressing start. Save the time for later
-                _last_start_down = std::chrono::system_clock::now();
+                _cold->last_start_down = now_ms();
             } else {
                 // This is the player releasing start. Check the time
-                auto now = std::chrono::system_clock::now();
-                if (std::chrono::duration_cast<std::chrono::milliseconds>(now - _last_start_down).count() > 1500) {
+                if (now_ms() - _cold->last_start_down > 1500) {
                     return true;
                 }
             }
@@ -272,7 +509,7 @@ public:
     }
 
     void set_game(const GameInfo *game) {
-        _game = game;
+        _game_id = game != nullptr ? game->id() : 0;
     }
 
     uint64_t mac() const {
@@ -286,34 +523,259 @@ public:
                     uint8_t r4, uint8_t g4, uint8_t b4,
                     uint8_t mask = 0, uint8_t match = 0);
 
-    void set_text(uint8_t x, uint8_t y, uint8_t style, const std::string &text);
+    /**
+     * Sends lights subject to the server's lights rate cap: if the badge was sent lights too recently,
+     * these wait and anything newer that arrives meanwhile replaces them
+     */
+    void set_lights(const LightData (&lights)[4], uint8_t mask = 0, uint8_t match = 0);
+
+    /**
+     * Writes a line of text, unless the screen already shows exactly that line
+     * @param x
+     * @param y
+     * @param style
+     * @param text
+     * @return false if it was already showing and nothing was sent
+     */
+    bool set_text(uint8_t x, uint8_t y, uint8_t style, const std::string &text);
+
+    /**
+     * Replaces everything on the screen: lines that are showing but aren't given are blanked, and only
+     * the given lines that differ from what is showing are sent
+     * @param lines
+     * @return how many of the given lines were already showing
+     */
+    size_t set_screen(const std::vector<ScreenLine> &lines);
+
+    /**
+     * Drops what the screen is believed to show, so every line is sent again
+     */
+    void forget_screen() {
+        _cold->screen.clear();
+    }
+
+    void set_lights_rssi(uint8_t min_rssi, uint8_t max_rssi, uint8_t led_intensity);
+    void set_lights_rainbow(uint16_t runtime, uint8_t speed, uint8_t intensity, uint8_t offset);
+    void configure(uint8_t requested_update, uint8_t disable_push, uint8_t disable_raw, uint8_t raw_rate);
+    void deep_sleep();
+    void request_status();
 };
 
-using ScanCallback = std::function<void(const Scan&)>;
-using StatusCallback = std::function<void(const Status&)>;
+static_assert(sizeof(BadgeInfo) <= 48, "BadgeInfo is on the packet path, keep it small");
+
+using ScanCallback = std::function<void(BadgeInfo&, const Scan&)>;
+using StatusCallback = std::function<void(BadgeInfo&, const StatusView&)>;
 using JoinCallback = std::function<void(uint64_t, const std::string&)>;
 using LeaveCallback = std::function<void(uint64_t, const std::string&)>;
-using NewBadgeCallback = std::function<void(uint64_t)>;
+using NewBadgeCallback = std::function<void(BadgeInfo&)>;
+using LocationCallback = std::function<void(BadgeInfo&, const std::string&)>;
+using StatusChangeCallback = std::function<void(BadgeInfo&, uint16_t, const Status&)>;
+using LostCallback = std::function<void(BadgeInfo&)>;
 
+/**
+ * One ingest worker: its own SO_REUSEPORT socket and the badges whose MAC is steered to it.
+ * Only the worker's thread adds badges, so other threads can look them up without locking.
+ */
+class Shard {
+    friend class Server;
 
-class Server {
+    static const size_t COMMAND_QUEUE_SIZE = 1024;
+
+    size_t _index;
     int _sockfd;
-    bool _running;
+
+    BadgeRegistry<BadgeInfo, BadgeCold> _badges;
+
+    // Changes asked for by other threads, and an eventfd that wakes the worker to run them
+    MpscRing<Command> _commands;
+    int _wakefd;
+    std::atomic<uint64_t> _commands_dropped;
+
+    std::atomic<uint64_t> _recv_calls;
+    std::atomic<uint64_t> _packets_received;
+
+    // Badges with a scan still arriving, checked for the scan timeout between batches
+    std::vector<BadgeInfo*> _pending_scans;
+
+    // Badges whose status changed since the last tick of the status change stream
+    std::vector<BadgeInfo*> _status_changes;
+    std::chrono::steady_clock::time_point _last_status_tick;
+
+    // Badges with lights held back by the rate cap, and how many frames were replaced before going out
+    std::vector<BadgeInfo*> _held_lights;
+    uint64_t _lights_superseded;
+
+    // TEXT packets not sent because the badge was already showing that line
+    uint64_t _text_unchanged;
+
+    // The games as of the last check, so the packet path only loads the shared set when it has changed
+    std::shared_ptr<const GameSet> _games;
+    uint64_t _games_version;
+
+    // When each badge will be lost, rearmed lazily: a badge only moves once its old deadline comes round
+    TimingWheel<BadgeInfo*> _expiry;
+
+    // Interrupts the worker's wait, for new commands or to stop
+    void wake();
+
+public:
+    explicit Shard(size_t index);
+    ~Shard();
+
+    Shard(const Shard&) = delete;
+    Shard &operator=(const Shard&) = delete;
+
+    size_t index() const { return _index; }
+};
+
+class Server {
+    friend class PacketDispatch<Server, Shard>;
+
+    // Passes datagrams from a worker's event loop to the packet handlers
+    class Receiver;
+
+    std::atomic<bool> _running;
+    std::atomic<bool> _stopping;
+
+    size_t _batch_size;
+    EventLoop::Backend _event_loop;
 
     ScanCallback _scan_callback;
     StatusCallback _status_callback;
     JoinCallback _join_callback;
     LeaveCallback _leave_callback;
     NewBadgeCallback _new_badge_callback;
+    LocationCallback _location_callback;
+    StatusChangeCallback _status_change_callback;
+    LostCallback _lost_callback;
+
+    StatusThresholds _status_thresholds;
+    std::chrono::milliseconds _status_tick;
+    std::chrono::milliseconds _badge_timeout;
+    // 0 sends every lights packet as it comes
+    std::chrono::milliseconds _lights_interval;
+    // Empty when not capturing; each worker writes its own file with its index on the end
+    std::string _capture_path;
+
+    std::vector<std::unique_ptr<Shard>> _shards;
+    // Registering a game swaps in a new set. The old one lasts until the last worker or handler holding it
+    // lets go; the version tells workers when to pick up the new one.
+    std::mutex _games_mutex;
+    LocationTable _locations;
+    std::shared_ptr<const GameSet> _games;
+    std::atomic<uint64_t> _games_version;
+
+    // Replaced whole on every change; workers hold a reference only while they classify one scan
+    std::mutex _fingerprints_mutex;
+    std::shared_ptr<const FingerprintDb> _fingerprints;
+    size_t _location_neighbours;
+
+    Shard &shard_for(uint64_t mac) {
+        return *_shards[shard_index(mac, _shards.size())];
+    }
 
+    int open_socket(bool reuse_port);
+    bool attach_steering(int sockfd);
+    /**
+     * Handles one shard's packets and commands until the server stops
+     * @param shard
+     * @return false if the worker couldn't start
+     */
+    bool run_worker(Shard &shard);
+    std::chrono::milliseconds timer_interval() const;
+    void run_timers(Shard &shard);
+
+    void on_packet(Shard &shard, struct sockaddr_in &address, const StatusView &status);
+    void on_packet(Shard &shard, struct sockaddr_in &address, const ScanView &scan);
+    void on_malformed(Shard &shard, struct sockaddr_in &address, const char *data, size_t len);
+    void on_unknown(Shard &shard, struct sockaddr_in &address, const char *data, size_t len);
+
+    void handle_data(Shard &shard, struct sockaddr_in &address, const char *data, ssize_t len);
+    void expire_scans(Shard &shard);
+    void on_scan_complete(BadgeInfo &badge);
+    void publish_status_changes(Shard &shard);
+    void expire_badges(Shard &shard);
+    void flush_lights(Shard &shard);
+    void on_badge_lost(Shard &shard, BadgeInfo &badge);
+
+    /**
+     * Only the worker that owns the badge may use what this returns
+     * @param mac
+     * @return the badge, or nullptr if it isn't known
+     */
+    BadgeInfo *find_badge(uint64_t mac);
 
-    std::unordered_map<uint64_t, BadgeInfo> _badge_ips;
-    std::vector<GameInfo> _games;
+    /**
+     * @param shard
+     * @return the worker's snapshot of the games, brought up to date if a game was registered since
+     */
+    const GameSet &games(Shard &shard);
+
+    bool post(Shard &shard, const Command &command);
+    void run_commands(Shard &shard);
+    void run_command(Shard &shard, const Command &command);
 
 public:
     Server()
-            : _sockfd(-1),
-              _running(false) {}
+            : _running(false),
+              _stopping(false),
+              _batch_size(32),
+              _event_loop(EventLoop::Backend::AUTO),
+              _status_tick(100),
+              _badge_timeout(30000),
+              _lights_interval(1000 / 30),
+              _games(new GameSet()),
+              _games_version(0),
+              _fingerprints(new FingerprintDb()),
+              _location_neighbours(3) {
+        set_workers(1);
+    }
+
+    /**
+     * Sets how many datagrams may be drained from the socket per receive call. Must be called before run().
+     * @param batch_size
+     */
+    void set_batch_size(size_t batch_size) {
+        _batch_size = batch_size > 0 ? batch_size : 1;
+    }
+
+    /**
+     * Sets how the workers wait for datagrams. Must be called before run().
+     * @param backend
+     */
+    void set_event_loop(EventLoop::Backend backend) {
+        _event_loop = backend;
+    }
+
+    /**
+     * Sets how many ingest workers to start, each with its own socket and share of the badges.
+     * Must be called before open() or run().
+     * @param workers
+     */
+    void set_workers(size_t workers) {
+        _shards.clear();
+        for (size_t i = 0; i < (workers > 0 ? workers : 1); i++) {
+            _shards.emplace_back(new Shard(i));
+        }
+    }
+
+    size_t workers() const { return _shards.size(); }
+
+    /**
+     * A socket bound to the badge port, for threads other than the workers to send from
+     */
+    int send_socket() const { return _shards[0]->_sockfd; }
+
+    /**
+     * The worker a badge belongs to. This must agree with the BPF program in attach_steering(),
+     * which takes the low 32 bits of the MAC (bytes 2-5 of every packet) modulo the worker count.
+     */
+    static size_t shard_index(uint64_t mac, size_t count) {
+        return (uint32_t)mac % count;
+    }
+
+    uint64_t recv_calls() const;
+    uint64_t packets_received() const;
 
     void set_on_scan(ScanCallback cb) {
         _scan_callback = cb;
@@ -335,29 +797,125 @@ public:
         _new_badge_callback = cb;
     }
 
+    void set_on_location(LocationCallback cb) {
+        _location_callback = cb;
+    }
+
+    /**
+     * Reports the fields of each badge's status that changed, at most once per badge per tick. Called on
+     * the ingest workers with the badge, the STATUS_FIELD bits that changed and its latest status.
+     * @param cb
+     */
+    void set_on_status_change(StatusChangeCallback cb) {
+        _status_change_callback = cb;
+    }
+
+    /**
+     * Reports a badge that has gone quiet for longer than the badge timeout, just before it is forgotten.
+     * Called on the ingest workers, after the leave callback if the badge was in a game.
+     * @param cb
+     */
+    void set_on_lost(LostCallback cb) {
+        _lost_callback = cb;
+    }
+
+    void set_status_thresholds(const StatusThresholds &thresholds) {
+        _status_thresholds = thresholds;
+    }
+
+    /**
+     * Sets how often status changes are reported. Must be called before run().
+     * @param tick
+     */
+    void set_status_tick(std::chrono::milliseconds tick) {
+        _status_tick = tick;
+    }
+
+    /**
+     * Caps how often lights are sent to any one badge. Lights that come too soon wait for their turn, and
+     * only the newest waiting lights go out. Must be called before run().
+     * @param hz 0 to send every lights packet straight away
+     */
+    void set_lights_rate(unsigned hz) {
+        _lights_interval = std::chrono::milliseconds(hz > 0 ? std::max(1u, 1000 / hz) : 0);
+    }
+
+    /**
+     * Sends lights to a badge under the lights rate cap. Only the badge's worker may call this.
+     * @param badge
+     * @param lights
+     * @param mask
+     * @param match
+     */
+    void send_lights(BadgeInfo &badge, const LightData (&lights)[4], uint8_t mask, uint8_t match);
+
+    /**
+     * Makes every worker append each datagram it receives to a capture file, path.<worker>, for
+     * replay(). Must be called before run().
+     * @param path empty to not capture
+     */
+    void set_capture(const std::string &path) {
+        _capture_path = path;
+    }
+
+    /**
+     * Sets how long a badge may go without sending a status before it is lost
+     * @param timeout
+     */
+    void set_badge_timeout(std::chrono::milliseconds timeout) {
+        _badge_timeout = timeout;
+    }
+
+    /**
+     * Sets how many of the nearest fingerprints vote on a badge's location
+     * @param neighbours
+     */
+    void set_location_neighbours(size_t neighbours) {
+        _location_neighbours = neighbours > 0 ? neighbours : 1;
+    }
+
+    std::shared_ptr<const FingerprintDb> fingerprints() const {
+        return std::atomic_load(&_fingerprints);
+    }
+
+    /**
+     * Teaches the location engine what can be heard at a location
+     * @param location
+     * @param stations RSSI by BSSID
+     */
+    void add_fingerprint(const std::string &location, std::vector<std::pair<uint64_t, int8_t>> stations);
+
+    /**
+     * @param location the location to forget, or empty to forget every fingerprint
+     * @return how many fingerprints were removed
+     */
+    size_t clear_fingerprints(const std::string &location = "");
+
+    /**
+     * Registers a game, or changes how players join one that already exists
+     * @param name
+     * @param sequence
+     * @param location
+     * @throws std::runtime_error if another game already uses the sequence or location
+     */
     void new_game(const std::string &name, const std::string &sequence = "", const std::string &location = "") {
-        GameInfo *found_game = nullptr;
+        std::lock_guard<std::mutex> lock(_games_mutex);
 
-        for (auto &game : _games) {
-            if (game.name() == name) {
-                found_game = &game;
-            } else {
-                if (game.use_sequence() && game.sequence() == sequence) {
-                    throw "Sequence " + sequence + " already in use by " + game.name();
-                }
+        std::shared_ptr<const GameSet> games(std::atomic_load(&_games)->with_game(name, sequence, location,
+                                                                                _locations));
+        std::atomic_store(&_games, games);
+        _games_version.fetch_add(1, std::memory_order_release);
+    }
 
-                if (game.use_location() && game.location() == location) {
-                    throw "Location " + location + " already in use by " + game.name();
-                }
-            }
-        }
+    /**
+     * @return the current games. Anything found in them stays valid for as long as this is held.
+     */
+    std::shared_ptr<const GameSet> games() const {
+        return std::atomic_load(&_games);
+    }
 
-        if (found_game != nullptr) {
-            found_game->set_sequence(sequence);
-            found_game->set_location(location);
-        } else {
-            _games.emplace_back(name, sequence, location);
-        }
+    LocationTable &locations() {
+        return _locations;
     }
 
     const std::vector<uint64_t> game_players(const std::string &name);
@@ -367,20 +925,100 @@ public:
 
     void send_packet(BadgeInfo *badge, const char *packet, size_t packet_len);
     void send_packet(BadgeInfo &badge, const char *packet, size_t packet_len);
+    // These look the badge up, so only its worker may use them
     void send_packet(MacAddress &mac, const char *packet, size_t packet_len);
     void send_packet(uint64_t mac, const char *packet, size_t packet_len);
 
-    BadgeInfo *find_badge(uint64_t mac);
-
-    template<typename M, typename... Args>
-    void try_badge_call(M m, uint64_t mac, Args&&... args) {
-        auto badge = find_badge(mac);
-        if (badge != nullptr) {
-            std::bind(m, badge, std::forward<Args>(args)...)();
+    /**
+     * Encodes a packet for a badge. On a worker it is written straight into the send queue; elsewhere it
+     * is built on the stack and sent immediately.
+     * @tparam type
+     * @param badge
+     * @param args see PacketTraits<type>::encode
+     */
+    template<uint8_t type, typename... Args>
+    void send(BadgeInfo &badge, const Args&... args) {
+        size_t len = PacketTraits<type>::length(args...);
+
+        SendQueue *queue = SendQueue::current();
+        char *slot = queue != nullptr ? queue->reserve(badge.sock_address(), len) : nullptr;
+        if (slot != nullptr) {
+            encode_packet<type>(slot, badge.mac(), args...);
+            return;
         }
+
+        char packet[MAX_PACKET_SIZE];
+        send_packet(badge, packet, encode_packet<type>(packet, badge.mac(), args...));
     }
 
-    void run();
+    /*
+     * These can be called from any thread. They only queue a command for the worker that owns the badge,
+     * which carries it out between receive batches; they return false if that queue is full.
+     */
+
+    bool set_lights(uint64_t mac, const LightData (&lights)[4], uint8_t mask = 0, uint8_t match = 0);
+    bool set_text(uint64_t mac, uint8_t x, uint8_t y, uint8_t style, const std::string &text);
+
+    /**
+     * Sets every line of a badge's screen at once. See BadgeInfo::set_screen
+     * @param mac
+     * @param lines
+     * @return false if the queue is full, or the lines together are too long to fit in one command
+     */
+    bool set_screen(uint64_t mac, const std::vector<ScreenLine> &lines);
+
+    bool request_scan(uint64_t mac);
+
+    /**
+     * Takes a badge out of its game and turns its lights off. If it was in one, the worker calls the leave
+     * callback, as it does when a badge is lost.
+     * @param mac
+     * @return false if the queue is full
+     */
+    bool kick(uint64_t mac);
+
+    /**
+     * Sets the lights of every badge in a game. Each worker sends to its own players, queueing the packets
+     * so they go out in a few calls.
+     * @param game_name
+     * @param lights
+     * @param mask
+     * @param match
+     * @return how many badges in the game the lights were queued for, leaving out those of a worker whose
+     *         queue was full
+     */
+    size_t set_game_lights(const std::string &game_name, const LightData (&lights)[4],
+                           uint8_t mask = 0, uint8_t match = 0);
+
+    /**
+     * Opens the workers' sockets. If the kernel won't steer datagrams between them, only one worker is kept,
+     * which changes which worker owns each badge, so call this before any other thread uses the server.
+     * run() calls it if it hasn't been.
+     * @return false if a socket couldn't be opened
+     */
+    bool open();
+
+    /**
+     * Receives and handles packets until stop() is called
+     * @return false if it couldn't start, or stopped because a worker couldn't
+     */
+    bool run();
+
+    /**
+     * Feeds captured datagrams through the packet handlers on this thread, in the order they arrived,
+     * instead of receiving them. Nothing is sent: replies are counted and dropped. Call this instead of
+     * run(); stop() ends it early.
+     * @param paths capture files, such as the ones each worker wrote
+     * @param realtime keep the gaps between datagrams as they were captured, rather than going flat out
+     * @return how many datagrams were replayed, or 0 if a file couldn't be read
+     */
+    uint64_t replay(const std::vector<std::string> &paths, bool realtime);
+
+    /**
+     * Wakes every worker and makes run() return once they have finished what they were doing.
+     * Safe to call from any thread, before or during run().
+     */
+    void stop();
 };
 
 #endif
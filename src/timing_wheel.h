@@ -0,0 +1,114 @@
+#ifndef TIMING_WHEEL_H
+#define TIMING_WHEEL_H
+
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * Deadlines for lots of items, in whole ticks, as a hierarchical timing wheel.
+ *
+ * There are LEVELS wheels of SLOTS buckets, each level's buckets SLOTS times wider than the one below, so
+ * four levels of 64 reach 16 million ticks ahead. Scheduling drops the item into the bucket its deadline
+ * falls in, and every tick fires one bucket of the finest wheel; whenever a wheel comes round, the next
+ * bucket of the wheel above is spread out into the finer ones. Both are O(1) per item, with no sweep over
+ * everything scheduled.
+ *
+ * Items can't be cancelled or moved. An owner whose deadline changes just leaves the old one in place,
+ * checks when it fires and schedules again, so pushing a deadline back costs nothing until it comes due.
+ */
+template<typename T>
+class TimingWheel {
+    static const unsigned BITS = 6;
+    static const unsigned SLOTS = 1u << BITS;
+    static const unsigned LEVELS = 4;
+    static const uint64_t HORIZON = 1ull << (BITS * LEVELS);
+
+    struct Timer {
+        T item;
+        uint64_t deadline;
+    };
+
+    uint64_t _now;
+    size_t _size;
+    std::vector<Timer> _slots[LEVELS][SLOTS];
+
+    // The bucket being fired or spread out; swapped with it so both keep their capacity
+    std::vector<Timer> _due;
+
+    void place(const Timer &timer) {
+        uint64_t delta = timer.deadline - _now;
+
+        unsigned level = 0;
+        while (level + 1 < LEVELS && delta >= 1ull << (BITS * (level + 1))) {
+            level++;
+        }
+
+        _slots[level][(timer.deadline >> (BITS * level)) & (SLOTS - 1)].push_back(timer);
+    }
+
+public:
+    explicit TimingWheel(uint64_t now = 0)
+            : _now(now),
+              _size(0),
+              _due() {}
+
+    TimingWheel(const TimingWheel&) = delete;
+    TimingWheel &operator=(const TimingWheel&) = delete;
+
+    /**
+     * @return the last tick advance() reached
+     */
+    uint64_t now() const { return _now; }
+
+    size_t size() const { return _size; }
+
+    /**
+     * @param item
+     * @param deadline the tick to fire on; ones already past fire on the next tick, and ones beyond the
+     *                 horizon fire at it
+     */
+    void schedule(T item, uint64_t deadline) {
+        if (deadline <= _now) {
+            deadline = _now + 1;
+        } else if (deadline - _now >= HORIZON) {
+            deadline = _now + HORIZON - 1;
+        }
+
+        place(Timer{item, deadline});
+        _size++;
+    }
+
+    /**
+     * Moves time on, firing everything whose deadline is reached on the way. The callback may schedule
+     * more items, including the one it was given.
+     * @param to
+     * @param fire called with each item that is due
+     */
+    template<typename F>
+    void advance(uint64_t to, F fire) {
+        while (_now < to) {
+            _now++;
+
+            // Each coarser wheel comes round once all the ones below it have
+            for (unsigned level = 1; level < LEVELS && (_now & ((1ull << (BITS * level)) - 1)) == 0; level++) {
+                _due.clear();
+                _due.swap(_slots[level][(_now >> (BITS * level)) & (SLOTS - 1)]);
+
+                for (const Timer &timer : _due) {
+                    place(timer);
+                }
+            }
+
+            _due.clear();
+            _due.swap(_slots[0][_now & (SLOTS - 1)]);
+            _size -= _due.size();
+
+            for (const Timer &timer : _due) {
+                fire(timer.item);
+            }
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,123 @@
+#include <string.h>
+
+#include "topics.h"
+
+#define VERB_SLOTS 16
+
+struct VerbSlot {
+    const char *name;
+    size_t len;
+    BadgeVerb verb;
+};
+
+/*
+ * Perfect hash over the verbs we know: no two share a slot, which the static_asserts below check, so a
+ * lookup is one hash and at most one compare. Adding a verb may mean changing the multiplier.
+ */
+static constexpr size_t verb_hash(const char *name, size_t len) {
+    return (len + 2 * (uint8_t)name[0] + (uint8_t)name[len - 1]) % VERB_SLOTS;
+}
+
+static constexpr size_t constexpr_strlen(const char *s) {
+    return *s == '\0' ? 0 : 1 + constexpr_strlen(s + 1);
+}
+
+#define VERB(name, verb) {name, sizeof(name) - 1, verb}
+
+static constexpr VerbSlot VERBS[VERB_SLOTS] = {
+        /*  0 */ VERB("text", BadgeVerb::TEXT),
+        /*  1 */ {nullptr, 0, BadgeVerb::UNKNOWN},
+        /*  2 */ {nullptr, 0, BadgeVerb::UNKNOWN},
+        /*  3 */ {nullptr, 0, BadgeVerb::UNKNOWN},
+        /*  4 */ VERB("clear_text", BadgeVerb::CLEAR_TEXT),
+        /*  5 */ {nullptr, 0, BadgeVerb::UNKNOWN},
+        /*  6 */ {nullptr, 0, BadgeVerb::UNKNOWN},
+        /*  7 */ {nullptr, 0, BadgeVerb::UNKNOWN},
+        /*  8 */ VERB("lights_static", BadgeVerb::LIGHTS_STATIC),
+        /*  9 */ {nullptr, 0, BadgeVerb::UNKNOWN},
+        /* 10 */ VERB("screen", BadgeVerb::SCREEN),
+        /* 11 */ {nullptr, 0, BadgeVerb::UNKNOWN},
+        /* 12 */ {nullptr, 0, BadgeVerb::UNKNOWN},
+        /* 13 */ {nullptr, 0, BadgeVerb::UNKNOWN},
+        /* 14 */ VERB("request_scan", BadgeVerb::REQUEST_SCAN),
+        /* 15 */ {nullptr, 0, BadgeVerb::UNKNOWN},
+};
+
+#undef VERB
+
+static constexpr bool in_place(size_t slot) {
+    return VERBS[slot].name == nullptr
+           || (VERBS[slot].len == constexpr_strlen(VERBS[slot].name)
+               && verb_hash(VERBS[slot].name, VERBS[slot].len) == slot);
+}
+
+static constexpr bool all_in_place(size_t slot) {
+    return slot == VERB_SLOTS || (in_place(slot) && all_in_place(slot + 1));
+}
+
+static_assert(all_in_place(0), "Verb is in the wrong slot");
+
+BadgeVerb find_verb(const char *name, size_t len) {
+    if (len == 0) {
+        return BadgeVerb::UNKNOWN;
+    }
+
+    const VerbSlot &slot = VERBS[verb_hash(name, len)];
+    if (slot.len == len && memcmp(slot.name, name, len) == 0) {
+        return slot.verb;
+    }
+
+    return BadgeVerb::UNKNOWN;
+}
+
+bool parse_badge_topic(const char *topic, size_t len, uint64_t &badge_id, BadgeVerb &verb) {
+    static const char PREFIX[] = "badge.";
+    static const size_t PREFIX_LEN = sizeof(PREFIX) - 1;
+
+    if (len <= PREFIX_LEN || memcmp(topic, PREFIX, PREFIX_LEN) != 0) {
+        return false;
+    }
+
+    const char *p = topic + PREFIX_LEN;
+    const char *end = topic + len;
+    uint64_t id = 0;
+
+    if (*p < '0' || *p > '9') {
+        return false;
+    }
+
+    for (; p < end && *p >= '0' && *p <= '9'; p++) {
+        uint64_t digit = (uint64_t)(*p - '0');
+        if (id > (UINT64_MAX - digit) / 10) {
+            return false;
+        }
+
+        id = id * 10 + digit;
+    }
+
+    if (p == end || *p != '.') {
+        return false;
+    }
+
+    badge_id = id;
+    verb = find_verb(p + 1, (size_t)(end - p - 1));
+    return true;
+}
+
+bool parse_game_topic(const char *topic, size_t len, std::string &game_id) {
+    static const char PREFIX[] = "game.";
+    static const size_t PREFIX_LEN = sizeof(PREFIX) - 1;
+
+    if (len <= PREFIX_LEN || memcmp(topic, PREFIX, PREFIX_LEN) != 0) {
+        return false;
+    }
+
+    const char *id = topic + PREFIX_LEN;
+    const char *dot = static_cast<const char*>(memchr(id, '.', len - PREFIX_LEN));
+    if (dot == nullptr || dot == id) {
+        return false;
+    }
+
+    game_id.assign(id, (size_t)(dot - id));
+    return true;
+}
@@ -0,0 +1,55 @@
+#ifndef TOPICS_H
+#define TOPICS_H
+
+#include <string>
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * The commands that can be sent to a badge as badge.<id>.<verb>
+ */
+enum class BadgeVerb : uint8_t {
+    UNKNOWN = 0,
+    LIGHTS_STATIC,
+    REQUEST_SCAN,
+    TEXT,
+    CLEAR_TEXT,
+    SCREEN,
+    COUNT,
+};
+
+/**
+ * @param name
+ * @param len
+ * @return the verb with this name, or UNKNOWN
+ */
+BadgeVerb find_verb(const char *name, size_t len);
+
+/**
+ * Splits a badge.<id>.<verb> topic in one pass, without allocating
+ * @param topic
+ * @param len
+ * @param badge_id set to the decimal id
+ * @param verb set to the verb, or UNKNOWN if it isn't one we know
+ * @return false if the topic doesn't have that shape or the id doesn't fit in 64 bits
+ */
+bool parse_badge_topic(const char *topic, size_t len, uint64_t &badge_id, BadgeVerb &verb);
+
+inline bool parse_badge_topic(const std::string &topic, uint64_t &badge_id, BadgeVerb &verb) {
+    return parse_badge_topic(topic.data(), topic.size(), badge_id, verb);
+}
+
+/**
+ * Takes the game id out of a game.<id>.<event> topic
+ * @param topic
+ * @param len
+ * @param game_id set to the id, which can't contain a dot
+ * @return false if the topic doesn't have that shape
+ */
+bool parse_game_topic(const char *topic, size_t len, std::string &game_id);
+
+inline bool parse_game_topic(const std::string &topic, std::string &game_id) {
+    return parse_game_topic(topic.data(), topic.size(), game_id);
+}
+
+#endif
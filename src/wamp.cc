@@ -1,6 +1,6 @@
 #include "wamp.h"
+#include "log.h"
 
-#include <regex>
 
 using namespace std::placeholders;
 
@@ -11,34 +11,113 @@ int64_t now() {
 }
 
 
-void Wamp::on_scan(const Scan &scan) {
-    wampcc::json_object data;
+BadgeTopics::BadgeTopics(uint64_t badge_id) {
+    std::string prefix = "badge." + std::to_string(badge_id);
+
+    scan = prefix + ".scan";
+    button_press = prefix + ".button.press";
+    button_release = prefix + ".button.release";
+    status = prefix + ".status";
+    location = prefix + ".location";
+
+    kwargs.emplace("badge_id", badge_id);
+}
+
+const BadgeTopics &Wamp::topics(BadgeInfo &badge) {
+    // Badges are normally given their topics by on_new_badge, but may predate the callbacks
+    if (badge.user_data() == nullptr) {
+        badge.set_user_data(std::make_shared<BadgeTopics>(badge.mac()));
+    }
+
+    return *static_cast<const BadgeTopics*>(badge.user_data());
+}
+
+void Wamp::on_scan(BadgeInfo &badge, const Scan &scan) {
+    if (_scan_window.count() > 0) {
+        std::lock_guard<std::mutex> lock(_scans_mutex);
+        _scans.push_back(ScanRecord{badge.mac(), scan.timestamp(), scan.stations()});
+        return;
+    }
+
+    const BadgeTopics &t = topics(badge);
+
+    wampcc::json_object data(t.kwargs);
     data.emplace("timestamp", scan.timestamp());
-    data.emplace("badge_id", (uint64_t)scan.mac_address());
 
     wampcc::json_array stations;
-    for (const ScanStation &st : scan.stations()) {
+    for (const auto &st : scan.stations()) {
         stations.emplace_back(wampcc::json_object({{"bssid", (const std::string&)st.mac()},
                                                    {"rssi", st.rssi()},
                                                    {"channel", st.channel()}}));
     }
 
-    data.insert(std::make_pair("stations", stations));
+    data.insert(std::make_pair("stations", std::move(stations)));
+
+    wampcc::wamp_args args{{}, std::move(data)};
+    _session->publish(t.scan, {}, std::move(args));
+}
+
+/*
+ * Publishes everything collected in the last window as one event, each scan a compact array:
+ * [badge_id, timestamp, [[bssid, rssi, channel], ...]] with the BSSID as an integer
+ */
+void Wamp::flush_scans() {
+    std::vector<ScanRecord> scans;
+    {
+        std::lock_guard<std::mutex> lock(_scans_mutex);
+        scans.swap(_scans);
+    }
+
+    if (scans.empty()) {
+        return;
+    }
+
+    wampcc::json_array records;
+    records.reserve(scans.size());
+
+    for (const auto &scan : scans) {
+        wampcc::json_array stations;
+        stations.reserve(scan.stations.size());
+
+        for (const auto &st : scan.stations) {
+            stations.emplace_back(wampcc::json_array({(uint64_t)st.mac(), st.rssi(), st.channel()}));
+        }
+
+        records.emplace_back(wampcc::json_array({scan.badge_id, scan.timestamp, std::move(stations)}));
+    }
 
-    wampcc::wamp_args args{{}, data};
-    _session->publish("badge." + std::to_string((uint64_t)scan.mac_address()) + ".scan", data, std::move(args));
+    _session->publish("badges.scans", {}, {std::move(records), {{"window", (uint64_t)_scan_window.count()}}});
 }
 
-void Wamp::on_status(const Status &status) {
+void Wamp::on_status(BadgeInfo &badge, const StatusView &status) {
     if (status.last_button() != BUTTON::NONE) {
-        wampcc::wamp_args args{{status.last_button_name()}, {
-                {"badge_id", (uint64_t)status.mac_address()},
-                {"timestamp", now()}}};
+        const BadgeTopics &t = topics(badge);
+
+        wampcc::json_object kwargs(t.kwargs);
+        kwargs.emplace("timestamp", now());
 
-        _session->publish("badge." + std::to_string((uint64_t)status.mac_address()) + ".button." + (status.button_down() ? "press" : "release"), {}, std::move(args));
+        wampcc::wamp_args args{{status.last_button_name()}, std::move(kwargs)};
+        _session->publish(status.button_down() ? t.button_press : t.button_release, {}, std::move(args));
     }
 }
 
+void Wamp::on_status_change(BadgeInfo &badge, uint16_t fields, const Status &status) {
+    const BadgeTopics &t = topics(badge);
+    wampcc::json_object changes(t.kwargs);
+
+    if (fields & FIELD_VERSION)        changes.emplace("version", status.version());
+    if (fields & FIELD_RSSI)           changes.emplace("rssi", status.rssi());
+    if (fields & FIELD_BSSID)          changes.emplace("bssid", (std::string)status.bssid());
+    if (fields & FIELD_GPIO_STATE)     changes.emplace("gpio_state", status.gpio_state());
+    if (fields & FIELD_SYSTEM_VOLTAGE) changes.emplace("system_voltage", status.system_voltage());
+    if (fields & FIELD_HEAP_FREE)      changes.emplace("heap_free", status.heap_free());
+    if (fields & FIELD_SLEEP_PERF)     changes.emplace("sleep_performance", status.sleep_performance());
+
+    changes.emplace("timestamp", now());
+
+    _session->publish(t.status, {}, {{}, std::move(changes)});
+}
+
 void Wamp::on_join(uint64_t badge_id, const std::string &game_name) {
     _session->publish("game." + game_name + ".player.join", {}, {{badge_id}, {}});
 }
@@ -47,8 +126,23 @@ void Wamp::on_leave(uint64_t badge_id, const std::string &game_name) {
     _session->publish("game." + game_name + ".player.leave", {}, {{badge_id}, {}});
 }
 
-void Wamp::on_new_badge(uint64_t badge_id) {
-    _session->publish("badges.new", {}, {{badge_id}, {}});
+void Wamp::on_new_badge(BadgeInfo &badge) {
+    topics(badge);
+
+    _session->publish("badges.new", {}, {{badge.mac()}, {}});
+}
+
+void Wamp::on_lost(BadgeInfo &badge) {
+    _session->publish("badges.lost", {}, {{badge.mac()}, {}});
+}
+
+void Wamp::on_location(BadgeInfo &badge, const std::string &location) {
+    const BadgeTopics &t = topics(badge);
+
+    wampcc::json_object kwargs(t.kwargs);
+    kwargs.emplace("timestamp", now());
+
+    _session->publish(t.location, {}, {{location}, std::move(kwargs)});
 }
 
 void Wamp::on_subscribe_cb(wampcc::wamp_subscribed &evt) {
@@ -66,14 +160,137 @@ void Wamp::on_lights(uint64_t badge_id,
                      int r4, int g4, int b4,
                      int match, int mask) {
 
-    _server->try_badge_call(&BadgeInfo::set_lights, badge_id, r1, g1, b1, r2, g2, b2, r3, g3, b3, r4, g4, b4, match, mask);
+    const LightData lights[4] {
+            {(uint8_t)g1, (uint8_t)r1, (uint8_t)b1},
+            {(uint8_t)g2, (uint8_t)r2, (uint8_t)b2},
+            {(uint8_t)g3, (uint8_t)r3, (uint8_t)b3},
+            {(uint8_t)g4, (uint8_t)r4, (uint8_t)b4},
+    };
+
+    _server->set_lights(badge_id, lights, (uint8_t)mask, (uint8_t)match);
 }
 
 void Wamp::on_text(uint64_t badge_id, int x, int y, uint8_t style, const std::string &text) {
-    _server->try_badge_call(&BadgeInfo::set_text, badge_id, x, y, style, text);
+    _server->set_text(badge_id, (uint8_t)x, (uint8_t)y, style, text);
+}
+
+size_t Wamp::on_game_lights(const std::string &game_id, const wampcc::json_array &colours, size_t offset) {
+    if (colours.size() < offset + 4) {
+        return 0;
+    }
+
+    LightData lights[4];
+    for (size_t i = 0; i < 4; i++) {
+        int c = colours[offset + i].as_int();
+        lights[i].red   = (uint8_t)((c >> 16) & 0xff);
+        lights[i].green = (uint8_t)((c >> 8) & 0xff);
+        lights[i].blue  = (uint8_t)(c & 0xff);
+    }
+
+    return _server->set_game_lights(game_id, lights);
 }
 
-static const std::regex badge_id_regex("badge\\.([0-9]+)\\..*");
+const Wamp::BadgeHandler Wamp::BADGE_HANDLERS[(size_t)BadgeVerb::COUNT] = {
+        /* UNKNOWN */       nullptr,
+        /* LIGHTS_STATIC */ &Wamp::on_lights_static,
+        /* REQUEST_SCAN */  &Wamp::on_request_scan,
+        /* TEXT */          &Wamp::on_text_event,
+        /* CLEAR_TEXT */    &Wamp::on_clear_text,
+        /* SCREEN */        &Wamp::on_screen,
+};
+
+void Wamp::on_badge_event(const wampcc::wamp_subscription_event &ev) {
+    auto topic = ev.details.find("topic");
+    if (topic == ev.details.end() || !topic->second.is_string()) {
+        return;
+    }
+
+    uint64_t badge_id;
+    BadgeVerb verb;
+    if (!parse_badge_topic(topic->second.as_string(), badge_id, verb) || verb == BadgeVerb::UNKNOWN) {
+        return;
+    }
+
+    (this->*BADGE_HANDLERS[(size_t)verb])(badge_id, ev.args.args_list, ev.args.args_dict);
+}
+
+void Wamp::on_lights_static(uint64_t badge_id, const wampcc::json_array &a, const wampcc::json_object &) {
+    if (a.size() < 4) return;
+
+    int a0 = a[0].as_int();
+    int a1 = a[1].as_int();
+    int a2 = a[2].as_int();
+    int a3 = a[3].as_int();
+    on_lights(badge_id,
+              (a0 >> 16) & 0xff, (a0 >> 8) & 0xff, a0 & 0xff,
+              (a1 >> 16) & 0xff, (a1 >> 8) & 0xff, a1 & 0xff,
+              (a2 >> 16) & 0xff, (a2 >> 8) & 0xff, a2 & 0xff,
+              (a3 >> 16) & 0xff, (a3 >> 8) & 0xff, a3 & 0xff,
+              0, 0);
+}
+
+void Wamp::on_request_scan(uint64_t badge_id, const wampcc::json_array &, const wampcc::json_object &) {
+    _server->request_scan(badge_id);
+}
+
+void Wamp::on_text_event(uint64_t badge_id, const wampcc::json_array &a, const wampcc::json_object &kwargs) {
+    if (a.size() < 3) return;
+
+    const std::string &text = a[2].as_string();
+    uint8_t opts = 0;
+    auto f = kwargs.find("style");
+    if (f != kwargs.end()) {
+        opts = (uint8_t)(f->second.as_uint() & 0xff);
+    }
+
+    on_text(badge_id, (uint8_t)a[0].as_uint(), (uint8_t)a[1].as_uint(), opts, text);
+}
+
+void Wamp::on_clear_text(uint64_t badge_id, const wampcc::json_array &, const wampcc::json_object &) {
+    on_text(badge_id, 0, 0, 1, "          ");
+    on_text(badge_id, 0, 16, 1, "          ");
+    on_text(badge_id, 0, 32, 1, "          ");
+    on_text(badge_id, 0, 48, 1, "          ");
+}
+
+// Each argument is one line, as [x, y, text] or [x, y, text, style]; the style kwarg is the default
+void Wamp::on_screen(uint64_t badge_id, const wampcc::json_array &a, const wampcc::json_object &kwargs) {
+    uint8_t style = 0;
+    auto f = kwargs.find("style");
+    if (f != kwargs.end()) {
+        style = (uint8_t)(f->second.as_uint() & 0xff);
+    }
+
+    std::vector<ScreenLine> lines;
+    for (const auto &arg : a) {
+        if (!arg.is_array() || arg.as_array().size() < 3) continue;
+
+        const wampcc::json_array &line = arg.as_array();
+        lines.push_back(ScreenLine{(uint8_t)line[0].as_uint(), (uint8_t)line[1].as_uint(),
+                                   line.size() > 3 ? (uint8_t)(line[3].as_uint() & 0xff) : style,
+                                   line[2].as_string()});
+    }
+
+    if (!_server->set_screen(badge_id, lines)) {
+        logger().message(LogLevel::WARN, "Screen for badge %llu not set", badge_id);
+    }
+}
+
+// Takes a BSSID as "aa:bb:cc:dd:ee:ff", the way scans are published
+static bool parse_mac(const std::string &text, uint64_t &mac) {
+    unsigned int b[6];
+    char end;
+    if (sscanf(text.c_str(), "%2x:%2x:%2x:%2x:%2x:%2x%c", &b[0], &b[1], &b[2], &b[3], &b[4], &b[5], &end) != 6) {
+        return false;
+    }
+
+    mac = 0;
+    for (unsigned int byte : b) {
+        mac = (mac << 8) | byte;
+    }
+
+    return true;
+}
 
 void Wamp::run() {
     try {
@@ -111,39 +328,15 @@ void Wamp::run() {
             throw std::runtime_error("realm logon failed");
         }
 
-        _session->subscribe("badge..lights_static", {{"match", "wildcard"}},
-                            std::bind(&Wamp::on_subscribe_cb, this, _1),
-                            [this] (wampcc::wamp_subscription_event ev) {
-                                auto a = ev.args.args_list;
-
-                                std::smatch res;
-                                if (std::regex_match(ev.details["topic"].as_string(), res, badge_id_regex)) {
-                                    uint64_t badge_id = std::stoull(res[1]);
-                                    int a0 = a[0].as_int();
-                                    int a1 = a[1].as_int();
-                                    int a2 = a[2].as_int();
-                                    int a3 = a[3].as_int();
-                                    on_lights(badge_id,
-                                              (a0 >> 16) & 0xff, (a0 >> 8) & 0xff, a0 & 0xff,
-                                              (a1 >> 16) & 0xff, (a1 >> 8) & 0xff, a1 & 0xff,
-                                              (a2 >> 16) & 0xff, (a2 >> 8) & 0xff, a2 & 0xff,
-                                              (a3 >> 16) & 0xff, (a3 >> 8) & 0xff, a3 & 0xff,
-                                              0, 0);
-                                }
-                            });
-
-        _session->subscribe("badge..request_scan", {{"match", "wildcard"}},
-                            std::bind(&Wamp::on_subscribe_cb, this, _1),
-                            [this] (wampcc::wamp_subscription_event ev) {
-                                auto a = ev.args.args_list;
-
-                                std::smatch res;
-                                if (std::regex_match(ev.details["topic"].as_string(), res, badge_id_regex)) {
-                                    uint64_t badge_id = std::stoull(res[1]);
-
-                                    _server->try_badge_call(&BadgeInfo::scan, badge_id);
-                                }
-                            });
+        // Every command for a single badge goes through the same topic router
+        for (const char *topic : {"badge..lights_static", "badge..request_scan", "badge..text", "badge..clear_text",
+                                  "badge..screen"}) {
+            _session->subscribe(topic, {{"match", "wildcard"}},
+                                std::bind(&Wamp::on_subscribe_cb, this, _1),
+                                [this] (wampcc::wamp_subscription_event ev) {
+                                    on_badge_event(ev);
+                                });
+        }
 
         _session->subscribe("game.kick", {},
                             std::bind(&Wamp::on_subscribe_cb, this, _1),
@@ -162,52 +355,31 @@ void Wamp::run() {
                                     return;
                                 }
 
-                                auto badge_it = _server->find_badge(badge_id_it->second.as_uint());
-                                if (badge_it != nullptr) {
-                                    badge_it->set_game(nullptr);
-                                    _session->publish("game." + game_it->second.as_string() + ".player.leave", {}, {{badge_it->mac()}, {}});
-                                    _server->try_badge_call(&BadgeInfo::set_lights, badge_it->mac(), 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
-                                }
-
+                                // The badge's worker takes it out of its game, and reports the leave if it was in one
+                                _server->kick(badge_id_it->second.as_uint());
                             });
 
-        _session->subscribe("badge..text", {{"match", "wildcard"}},
+        _session->subscribe("game..lights", {{"match", "wildcard"}},
                             std::bind(&Wamp::on_subscribe_cb, this, _1),
                             [this] (wampcc::wamp_subscription_event ev) {
-                                auto a = ev.args.args_list;
-                                auto aa = ev.args.args_dict;
-
-                                if (a.size() < 3) return;
-
-                                std::smatch res;
-                                if (std::regex_match(ev.details["topic"].as_string(), res, badge_id_regex)) {
-                                    uint64_t badge_id = std::stoull(res[1]);
-
-                                    const std::string &text = a[2].as_string();
-                                    uint8_t opts = 0;
-                                    auto f = aa.find("style");
-                                    if (f != aa.end()) {
-                                        opts = (uint8_t)(f->second.as_uint() & 0xff);
-                                    }
-
-                                    std::cout << "Sending text " << text << std::endl;
-                                    on_text(badge_id, (uint8_t)a[0].as_uint(), (uint8_t)a[1].as_uint(), opts, text);
+                                std::string game_id;
+                                if (parse_game_topic(ev.details["topic"].as_string(), game_id)) {
+                                    on_game_lights(game_id, ev.args.args_list);
                                 }
                             });
 
-        _session->subscribe("badge..clear_text", {{"match", "wildcard"}},
-                            std::bind(&Wamp::on_subscribe_cb, this, _1),
-                            [this] (wampcc::wamp_subscription_event ev) {
-                                std::smatch res;
-                                if (std::regex_match(ev.details["topic"].as_string(), res, badge_id_regex)) {
-                                    uint64_t badge_id = std::stoull(res[1]);
-
-                                    on_text(badge_id, 0, 0, 1, "          ");
-                                    on_text(badge_id, 0, 16, 1, "          ");
-                                    on_text(badge_id, 0, 32, 1, "          ");
-                                    on_text(badge_id, 0, 48, 1, "          ");
-                                }
-                            });
+        _session->provide("game.lights", {}, [this](wampcc::wamp_invocation &invoc) {
+            auto &args = invoc.args.args_list;
+
+            // [game_id, colour, colour, colour, colour]
+            if (args.size() < 5) {
+                invoc.yield(wampcc::json_object {{"error", "game_id and four colours required"}});
+                return;
+            }
+
+            size_t sent = on_game_lights(args[0].as_string(), args, 1);
+            invoc.yield(wampcc::json_object {{"success", "Lights sent"}, {"badges", sent}});
+        });
 
         _session->provide("game.register", {}, [](wampcc::wamp_invocation &invoc) {
             auto *server = reinterpret_cast<Server*>(invoc.user);
@@ -258,6 +430,59 @@ void Wamp::run() {
             }
         }, _server.get());
 
+        _session->provide("location.train", {}, [](wampcc::wamp_invocation &invoc) {
+            auto *server = reinterpret_cast<Server*>(invoc.user);
+            auto kwargs = invoc.args.args_dict;
+
+            // {"location": name, "stations": [{"bssid": "aa:bb:cc:dd:ee:ff", "rssi": -60}, ...]}
+            auto floc = kwargs.find("location");
+            auto fstations = kwargs.find("stations");
+            if (floc == kwargs.end() || fstations == kwargs.end() || !fstations->second.is_array()) {
+                invoc.yield(wampcc::json_object {{"error", "location and stations required"}});
+                return;
+            }
+
+            std::vector<std::pair<uint64_t, int8_t>> stations;
+            for (const auto &station : fstations->second.as_array()) {
+                if (!station.is_object()) {
+                    continue;
+                }
+
+                auto fbssid = station.as_object().find("bssid");
+                auto frssi = station.as_object().find("rssi");
+                uint64_t bssid;
+
+                if (fbssid != station.as_object().end() && frssi != station.as_object().end()
+                    && parse_mac(fbssid->second.as_string(), bssid)) {
+                    stations.emplace_back(bssid, (int8_t)frssi->second.as_int());
+                }
+            }
+
+            if (stations.empty()) {
+                invoc.yield(wampcc::json_object {{"error", "no valid stations"}});
+                return;
+            }
+
+            try {
+                server->add_fingerprint(floc->second.as_string(), std::move(stations));
+                invoc.yield(wampcc::json_object {{"success", "Fingerprint added"},
+                                                 {"fingerprints", server->fingerprints()->size()}});
+            } catch (std::exception &e) {
+                invoc.yield(wampcc::json_object {{"error", e.what()}});
+            }
+        }, _server.get());
+
+        _session->provide("location.clear", {}, [](wampcc::wamp_invocation &invoc) {
+            auto *server = reinterpret_cast<Server*>(invoc.user);
+            auto args = invoc.args.args_list;
+
+            // [location], or nothing to clear every location
+            std::string location = args.empty() ? "" : args[0].as_string();
+            size_t removed = server->clear_fingerprints(location);
+
+            invoc.yield(wampcc::json_object {{"success", "Fingerprints removed"}, {"removed", removed}});
+        }, _server.get());
+
         _session->provide("badges.list", {}, [](wampcc::wamp_invocation &invoc) {
             auto *server = reinterpret_cast<Server*>(invoc.user);
             try {
@@ -286,16 +511,24 @@ void Wamp::run() {
             }
         }, _server.get());*/
 
-        _server->set_on_scan(std::bind(&Wamp::on_scan, this, _1));
-        _server->set_on_status(std::bind(&Wamp::on_status, this, _1));
+        _server->set_on_scan(std::bind(&Wamp::on_scan, this, _1, _2));
+        _server->set_on_status(std::bind(&Wamp::on_status, this, _1, _2));
         _server->set_on_join(std::bind(&Wamp::on_join, this, _1, _2));
         _server->set_on_leave(std::bind(&Wamp::on_leave, this, _1, _2));
         _server->set_on_new_badge(std::bind(&Wamp::on_new_badge, this, _1));
+        _server->set_on_location(std::bind(&Wamp::on_location, this, _1, _2));
+        _server->set_on_status_change(std::bind(&Wamp::on_status_change, this, _1, _2, _3));
+        _server->set_on_lost(std::bind(&Wamp::on_lost, this, _1));
 
         _session->publish("game.request_register", {}, {});
 
-        while (true) {
-            std::this_thread::sleep_for(std::chrono::seconds(1));
+        while (_running) {
+            if (_scan_window.count() > 0) {
+                std::this_thread::sleep_for(_scan_window);
+                flush_scans();
+            } else {
+                std::this_thread::sleep_for(std::chrono::seconds(1));
+            }
         }
 
     } catch (std::exception &e) {
@@ -3,26 +3,96 @@
 
 #include <wampcc/wampcc.h>
 #include <chrono>
+#include <mutex>
+#include <atomic>
+#include <vector>
 
 #include "packets.h"
 #include "server.h"
+#include "topics.h"
 
 int64_t now();
 
+/**
+ * A completed scan waiting for the next badges.scans publication
+ */
+struct ScanRecord {
+    uint64_t badge_id;
+    uint32_t timestamp;
+    std::vector<ScanStation> stations;
+};
+
+/**
+ * Everything about a badge that every event it publishes repeats, worked out once when it is first seen
+ * and kept in its user data slot
+ */
+struct BadgeTopics {
+    std::string scan;
+    std::string button_press;
+    std::string button_release;
+    std::string status;
+    std::string location;
+
+    // {"badge_id": id}, copied to start each event's kwargs
+    wampcc::json_object kwargs;
+
+    explicit BadgeTopics(uint64_t badge_id);
+};
+
 class Wamp {
     std::shared_ptr<Server> _server;
     std::shared_ptr<wampcc::wamp_session> _session;
+    std::atomic<bool> _running;
+
+    // 0 publishes every scan on its own badge.<id>.scan topic
+    std::chrono::milliseconds _scan_window;
+
+    // Filled by the ingest workers, emptied once per window by the WAMP thread
+    std::mutex _scans_mutex;
+    std::vector<ScanRecord> _scans;
+
+    void flush_scans();
+
+    static const BadgeTopics &topics(BadgeInfo &badge);
+
+    typedef void (Wamp::*BadgeHandler)(uint64_t badge_id, const wampcc::json_array &args,
+                                       const wampcc::json_object &kwargs);
+    static const BadgeHandler BADGE_HANDLERS[(size_t)BadgeVerb::COUNT];
+
+    void on_badge_event(const wampcc::wamp_subscription_event &ev);
+    void on_lights_static(uint64_t badge_id, const wampcc::json_array &args, const wampcc::json_object &kwargs);
+    void on_request_scan(uint64_t badge_id, const wampcc::json_array &args, const wampcc::json_object &kwargs);
+    void on_text_event(uint64_t badge_id, const wampcc::json_array &args, const wampcc::json_object &kwargs);
+    void on_clear_text(uint64_t badge_id, const wampcc::json_array &args, const wampcc::json_object &kwargs);
+    void on_screen(uint64_t badge_id, const wampcc::json_array &args, const wampcc::json_object &kwargs);
 
 public:
     explicit Wamp(std::shared_ptr<Server> server)
             : _server(server),
-              _session(nullptr) {}
+              _session(nullptr),
+              _running(true),
+              _scan_window(0) {}
 
-    void on_scan(const Scan &scan);
-    void on_status(const Status &status);
+    Wamp(const Wamp&) = delete;
+    Wamp &operator=(const Wamp&) = delete;
+
+    /**
+     * Collects completed scans for this long and publishes them together as one badges.scans event,
+     * instead of one badge.<id>.scan event each. Must be called before run().
+     * @param window 0 to publish each scan as it completes
+     */
+    void set_scan_window(std::chrono::milliseconds window) {
+        _scan_window = window;
+    }
+
+    void on_scan(BadgeInfo &badge, const Scan &scan);
+    void on_status(BadgeInfo &badge, const StatusView &status);
     void on_join(uint64_t badge_id, const std::string &game_name);
     void on_leave(uint64_t badge_id, const std::string &game_name);
-    void on_new_badge(uint64_t badge_id);
+    void on_new_badge(BadgeInfo &badge);
+    void on_location(BadgeInfo &badge, const std::string &location);
+    void on_status_change(BadgeInfo &badge, uint16_t fields, const Status &status);
+    void on_lost(BadgeInfo &badge);
 
     void on_subscribe_cb(wampcc::wamp_subscribed &evt);
     void on_lights(uint64_t badge_id,
@@ -32,8 +102,16 @@ public:
                    int r4, int g4, int b4,
                    int match=0, int mask=0);
     void on_text(uint64_t badge_id, int x, int y, uint8_t style, const std::string &text);
+    size_t on_game_lights(const std::string &game_id, const wampcc::json_array &colours, size_t offset = 0);
 
     void run();
+
+    /**
+     * Makes run() return, within a second or a scan window
+     */
+    void stop() {
+        _running = false;
+    }
 };
 
 #endif
@@ -0,0 +1,172 @@
+/*
+ * Stress test for BadgeRegistry: one writer inserts and erases badges as fast as it can, forcing index
+ * rebuilds, tombstones and slot reuse, while reader threads look badges up and walk the registry. Every
+ * record carries a check value derived from its MAC, and destroying it clears that, so a reader that sees
+ * a half-built or destroyed record, or one whose slot was reused under it, notices.
+ */
+
+#include <stdlib.h>
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "registry.h"
+
+#define READERS 4
+#define DURATION_MS 2000
+// Badges kept live at once; older ones are erased as new ones come in
+#define WINDOW 4096
+// Short, so slots are reused many times within the run, but far longer than any single lookup
+#define REUSE_DELAY_MS 200
+
+static uint64_t check_value(uint64_t mac) {
+    return mac * 0x9E3779B97F4A7C15ull ^ 0x5A5A5A5A5A5A5A5Aull;
+}
+
+struct TestCold {
+    std::string payload;
+};
+
+class TestBadge {
+    TestCold *_cold;
+    uint64_t _mac;
+    // Atomic so clearing it in the destructor isn't optimised away
+    std::atomic<uint64_t> _check;
+
+public:
+    TestBadge(TestCold *cold, uint64_t mac)
+            : _cold(cold),
+              _mac(mac),
+              _check(check_value(mac)) {
+        _cold->payload = std::to_string(mac);
+    }
+
+    // So a reader holding a badge that has been destroyed sees it as torn
+    ~TestBadge() {
+        _check.store(0, std::memory_order_relaxed);
+    }
+
+    uint64_t mac() const { return _mac; }
+
+    bool intact() const {
+        return _mac != 0 && _check.load(std::memory_order_relaxed) == check_value(_mac);
+    }
+};
+
+int main() {
+    BadgeRegistry<TestBadge, TestCold> registry(16, std::chrono::milliseconds(REUSE_DELAY_MS));
+
+    std::atomic<bool> done(false);
+    // The newest MAC inserted; everything from newest - WINDOW up is live
+    std::atomic<uint64_t> newest(0);
+
+    std::atomic<uint64_t> lookups(0);
+    std::atomic<uint64_t> walked(0);
+    std::atomic<uint64_t> torn(0);
+    std::atomic<uint64_t> wrong(0);
+
+    std::vector<std::thread> readers;
+    for (int i = 0; i < READERS; i++) {
+        readers.emplace_back([&, i]() {
+            std::mt19937_64 random(i + 1);
+            uint64_t found = 0;
+            uint64_t visited = 0;
+            // Badges found this round, looked at again at the end of it; many will have been erased by then
+            std::vector<std::pair<const TestBadge*, uint64_t>> held;
+
+            while (!done.load(std::memory_order_relaxed)) {
+                held.clear();
+
+                for (int n = 0; n < 1024; n++) {
+                    uint64_t top = newest.load(std::memory_order_acquire);
+                    if (top == 0) {
+                        break;
+                    }
+
+                    // Mostly badges that should be live, some that were just erased
+                    uint64_t back = random() % (WINDOW + WINDOW / 4);
+                    uint64_t mac = back < top ? top - back : 1 + random() % top;
+                    const TestBadge *badge = registry.find(mac);
+                    if (badge != nullptr) {
+                        found++;
+                        if (!badge->intact()) {
+                            torn++;
+                        } else if (badge->mac() != mac) {
+                            wrong++;
+                        } else {
+                            held.emplace_back(badge, mac);
+                        }
+                    }
+                }
+
+                // Half the readers walk too, so walks overlap lookups and each other
+                if (i % 2 == 0) {
+                    registry.for_each([&](const TestBadge &badge) {
+                        visited++;
+                        if (!badge.intact()) {
+                            torn++;
+                        }
+                    });
+                }
+
+                // A round is far shorter than the reuse delay, so even erased badges must still be whole
+                for (auto &badge : held) {
+                    if (!badge.first->intact()) {
+                        torn++;
+                    } else if (badge.first->mac() != badge.second) {
+                        wrong++;
+                    }
+                }
+            }
+
+            lookups += found;
+            walked += visited;
+        });
+    }
+
+    auto end = std::chrono::steady_clock::now() + std::chrono::milliseconds(DURATION_MS);
+    uint64_t mac = 0;
+    uint64_t erased = 0;
+    bool full = false;
+
+    while (std::chrono::steady_clock::now() < end) {
+        for (int n = 0; n < 256; n++) {
+            mac++;
+            if (registry.insert(mac, mac) == nullptr) {
+                full = true;
+                break;
+            }
+            newest.store(mac, std::memory_order_release);
+
+            if (mac > WINDOW) {
+                erased += registry.erase(mac - WINDOW);
+            }
+        }
+
+        if (full) {
+            break;
+        }
+    }
+
+    done = true;
+    for (auto &reader : readers) {
+        reader.join();
+    }
+
+    bool sized = registry.size() == std::min<uint64_t>(mac, WINDOW);
+
+    std::cout << "inserted " << mac << ", erased " << erased << ", " << lookups << " lookups found a badge, "
+              << walked << " badges walked" << std::endl;
+    std::cout << torn << " torn records, " << wrong << " lookups returned another badge" << std::endl;
+
+    if (full || !sized) {
+        std::cout << (full ? "registry filled up" : "registry size is wrong") << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    return torn == 0 && wrong == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
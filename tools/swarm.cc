@@ -0,0 +1,585 @@
+/*
+ * Load generator for the router: simulates a swarm of badges from one machine. Each virtual badge sends
+ * periodic statuses, with random button presses and now and then a join sequence, sends its scans in
+ * fragments, and answers the router the way a badge would. Some statuses are sent as reboots, which the
+ * router answers with lights; the time until those arrive is the round trip reported at the end.
+ */
+
+#include <getopt.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "packets.h"
+
+#define PORT 8000
+#define BATCH_SIZE 64
+#define MAX_DATAGRAM 1024
+// Badges send their scans a few stations at a time
+#define STATIONS_PER_FRAGMENT 8
+// How many access points the swarm's scans pick from
+#define ACCESS_POINTS 64
+// A probe that hasn't been answered by then counts as dropped
+#define PROBE_TIMEOUT_MS 1000
+#define REPORT_INTERVAL_MS 1000
+
+using Clock = std::chrono::steady_clock;
+
+struct SwarmOptions {
+    struct sockaddr_in router;
+    size_t badges;
+    unsigned threads;
+    unsigned duration;
+    double status_rate;
+    double scan_interval;
+    size_t stations;
+    double probe_rate;
+    double press_chance;
+    double join_chance;
+    std::string join;
+};
+
+/**
+ * Counted by every thread as it goes, and read by the main thread for the progress lines
+ */
+struct SwarmCounters {
+    std::atomic<uint64_t> sent;
+    std::atomic<uint64_t> received;
+    std::atomic<uint64_t> send_errors;
+    std::atomic<uint64_t> probes;
+    std::atomic<uint64_t> probes_lost;
+};
+
+struct VirtualBadge {
+    uint8_t mac[6];
+    uint16_t update_count;
+    uint32_t scan_timestamp;
+
+    // Pressed in the last status and released in the next one
+    BUTTON held;
+
+    // How far through the join sequence the badge is, or -1 when it isn't joining
+    int join_step;
+
+    bool probing;
+    Clock::time_point probe_sent;
+};
+
+/**
+ * One thread's share of the badges, on a socket of its own. Badge i belongs to thread i % threads, and
+ * its MAC ends in i, so a reply is matched to its badge without a lookup.
+ */
+class Swarm {
+    const SwarmOptions &_options;
+    SwarmCounters &_counters;
+    unsigned _index;
+
+    int _sockfd;
+    std::vector<VirtualBadge> _badges;
+    std::mt19937 _random;
+
+    char _out[BATCH_SIZE][MAX_DATAGRAM];
+    struct iovec _out_iovecs[BATCH_SIZE];
+    struct mmsghdr _out_msgs[BATCH_SIZE];
+    size_t _out_count;
+
+    char _in[BATCH_SIZE][MAX_DATAGRAM];
+    struct iovec _in_iovecs[BATCH_SIZE];
+    struct mmsghdr _in_msgs[BATCH_SIZE];
+
+    std::vector<uint32_t> _rtt_us;
+
+    double chance() {
+        return std::uniform_real_distribution<double>(0, 1)(_random);
+    }
+
+    void flush() {
+        size_t sent = 0;
+        while (sent < _out_count) {
+            int res = sendmmsg(_sockfd, &_out_msgs[sent], (unsigned int)(_out_count - sent), 0);
+            if (res < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+
+                // Whatever the socket wouldn't take is lost, the same as a badge's radio would lose it
+                _counters.send_errors += _out_count - sent;
+                break;
+            }
+
+            sent += res;
+        }
+
+        _counters.sent += sent;
+        _out_count = 0;
+    }
+
+    char *reserve(size_t len) {
+        if (_out_count == BATCH_SIZE) {
+            flush();
+        }
+
+        _out_iovecs[_out_count].iov_len = len;
+        return _out[_out_count++];
+    }
+
+    void send_status(VirtualBadge &badge, bool reboot) {
+        StatusPacket *packet = reinterpret_cast<StatusPacket*>(reserve(sizeof(StatusPacket)));
+        memset(packet, 0, sizeof(StatusPacket));
+
+        memcpy(packet->base.mac.mac, badge.mac, sizeof(badge.mac));
+        packet->base.type = STATUS;
+        packet->version = 1;
+        packet->rssi = (uint8_t)(128 - 40 - _random() % 50);
+        packet->bssid.mac[5] = (uint8_t)(_random() % ACCESS_POINTS);
+        packet->system_voltage = htons(3300);
+        packet->heap_free = htons(20000);
+        packet->time = htonl((uint32_t)std::chrono::duration_cast<std::chrono::milliseconds>(
+                Clock::now().time_since_epoch()).count());
+
+        // A count that goes backwards is how the router tells the badge rebooted
+        badge.update_count = reboot ? 0 : badge.update_count + 1;
+        packet->update_count = htons(badge.update_count);
+
+        if (badge.held != BUTTON::NONE) {
+            packet->last_button = (uint8_t)badge.held;
+            packet->button_down = 0;
+            badge.held = BUTTON::NONE;
+        } else if (badge.join_step >= 0) {
+            packet->last_button = (uint8_t)button_from_char(_options.join[badge.join_step]);
+            packet->button_down = 0;
+            if (++badge.join_step == (int)_options.join.size()) {
+                badge.join_step = -1;
+            }
+        } else if (!_options.join.empty() && chance() < _options.join_chance) {
+            badge.join_step = 0;
+        } else if (chance() < _options.press_chance) {
+            badge.held = (BUTTON)(1 + _random() % (int)BUTTON::A);
+            packet->last_button = (uint8_t)badge.held;
+            packet->button_down = 1;
+        }
+    }
+
+    void send_scan(VirtualBadge &badge) {
+        badge.scan_timestamp++;
+
+        size_t offset = _random() % ACCESS_POINTS;
+        for (size_t first = 0; first < _options.stations; first += STATIONS_PER_FRAGMENT) {
+            size_t count = std::min<size_t>(STATIONS_PER_FRAGMENT, _options.stations - first);
+
+            char *out = reserve(sizeof(ScanPacket) + count * sizeof(ScanData));
+            ScanPacket *packet = reinterpret_cast<ScanPacket*>(out);
+            memcpy(packet->base.mac.mac, badge.mac, sizeof(badge.mac));
+            packet->base.type = SCAN;
+            packet->timestamp = badge.scan_timestamp;
+            packet->station_count = (uint8_t)count;
+
+            ScanData *stations = reinterpret_cast<ScanData*>(packet + 1);
+            for (size_t i = 0; i < count; i++) {
+                memset(&stations[i], 0, sizeof(ScanData));
+                stations[i].bssid.mac[0] = 0x02;
+                stations[i].bssid.mac[5] = (uint8_t)((offset + first + i) % ACCESS_POINTS);
+                stations[i].rssi = (uint8_t)(128 - 30 - _random() % 60);
+                stations[i].channel = (uint8_t)(1 + _random() % 11);
+            }
+        }
+    }
+
+    void send_probe(VirtualBadge &badge) {
+        badge.probing = true;
+        badge.probe_sent = Clock::now();
+        _counters.probes++;
+
+        send_status(badge, true);
+    }
+
+    void on_reply(const char *data, size_t len) {
+        if (len < sizeof(BasePacket)) {
+            return;
+        }
+
+        const BasePacket *base = reinterpret_cast<const BasePacket*>(data);
+        size_t id = ((size_t)base->mac.mac[2] << 24) | ((size_t)base->mac.mac[3] << 16)
+                    | ((size_t)base->mac.mac[4] << 8) | base->mac.mac[5];
+        if (id % _options.threads != _index || id / _options.threads >= _badges.size()) {
+            return;
+        }
+
+        VirtualBadge &badge = _badges[id / _options.threads];
+
+        switch (base->type) {
+            case LIGHTS:
+                if (badge.probing) {
+                    badge.probing = false;
+                    _rtt_us.push_back((uint32_t)std::chrono::duration_cast<std::chrono::microseconds>(
+                            Clock::now() - badge.probe_sent).count());
+                }
+
+                // Badges report their new LED power straight back
+                send_status(badge, false);
+                break;
+
+            case TEXT:
+            case STATUS_REQUEST:
+                send_status(badge, false);
+                break;
+
+            case SCAN_REQUEST:
+                send_scan(badge);
+                break;
+
+            default:
+                break;
+        }
+    }
+
+    /**
+     * @return how many datagrams were waiting
+     */
+    size_t receive() {
+        size_t total = 0;
+
+        for (;;) {
+            for (size_t i = 0; i < BATCH_SIZE; i++) {
+                _in_iovecs[i].iov_len = MAX_DATAGRAM;
+                _in_msgs[i].msg_hdr.msg_flags = 0;
+            }
+
+            int res = recvmmsg(_sockfd, _in_msgs, BATCH_SIZE, MSG_DONTWAIT, nullptr);
+            if (res <= 0) {
+                break;
+            }
+
+            for (int i = 0; i < res; i++) {
+                on_reply(_in[i], _in_msgs[i].msg_len);
+            }
+
+            total += res;
+        }
+
+        _counters.received += total;
+        return total;
+    }
+
+    void expire_probes(Clock::time_point now) {
+        for (auto &badge : _badges) {
+            if (badge.probing && now - badge.probe_sent > std::chrono::milliseconds(PROBE_TIMEOUT_MS)) {
+                badge.probing = false;
+                _counters.probes_lost++;
+            }
+        }
+    }
+
+public:
+    Swarm(const SwarmOptions &options, SwarmCounters &counters, unsigned index)
+            : _options(options),
+              _counters(counters),
+              _index(index),
+              _sockfd(-1),
+              _badges(),
+              _random(index + 1),
+              _out_count(0),
+              _rtt_us() {
+        for (size_t id = index; id < options.badges; id += options.threads) {
+            VirtualBadge badge{};
+            badge.mac[0] = 0x02;
+            badge.mac[2] = (uint8_t)(id >> 24);
+            badge.mac[3] = (uint8_t)(id >> 16);
+            badge.mac[4] = (uint8_t)(id >> 8);
+            badge.mac[5] = (uint8_t)id;
+            badge.held = BUTTON::NONE;
+            badge.join_step = -1;
+            _badges.push_back(badge);
+        }
+
+        for (size_t i = 0; i < BATCH_SIZE; i++) {
+            _out_iovecs[i].iov_base = _out[i];
+            _out_msgs[i].msg_hdr = {};
+            _out_msgs[i].msg_hdr.msg_iov = &_out_iovecs[i];
+            _out_msgs[i].msg_hdr.msg_iovlen = 1;
+            _out_msgs[i].msg_hdr.msg_name = const_cast<struct sockaddr_in*>(&_options.router);
+            _out_msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+
+            _in_iovecs[i].iov_base = _in[i];
+            _in_msgs[i].msg_hdr = {};
+            _in_msgs[i].msg_hdr.msg_iov = &_in_iovecs[i];
+            _in_msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+    }
+
+    ~Swarm() {
+        if (_sockfd >= 0) {
+            close(_sockfd);
+        }
+    }
+
+    Swarm(const Swarm&) = delete;
+    Swarm &operator=(const Swarm&) = delete;
+
+    const std::vector<uint32_t> &rtt_us() const { return _rtt_us; }
+
+    void run() {
+        _sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+        if (_sockfd < 0) {
+            std::cerr << "ERROR opening socket" << std::endl;
+            return;
+        }
+
+        int buffer = 8 << 20;
+        setsockopt(_sockfd, SOL_SOCKET, SO_SNDBUF, &buffer, sizeof(buffer));
+        setsockopt(_sockfd, SOL_SOCKET, SO_RCVBUF, &buffer, sizeof(buffer));
+
+        if (_badges.empty()) {
+            return;
+        }
+
+        // Everything is owed at a steady rate from the start; a thread that falls behind catches up a
+        // batch at a time, so falling short shows up as a lower rate rather than a burst
+        double status_rate = _badges.size() * _options.status_rate;
+        double scan_rate = _options.scan_interval > 0 ? _badges.size() / _options.scan_interval : 0;
+        double probe_rate = _options.probe_rate / _options.threads;
+
+        uint64_t statuses = 0;
+        uint64_t scans = 0;
+        uint64_t probes = 0;
+        size_t next_probe = 0;
+
+        auto start = Clock::now();
+        auto end = start + std::chrono::seconds(_options.duration);
+        auto last_expiry = start;
+
+        for (auto now = start; now < end; now = Clock::now()) {
+            double elapsed = std::chrono::duration<double>(now - start).count();
+            bool busy = false;
+
+            for (size_t i = 0; i < 4 * BATCH_SIZE && statuses < elapsed * status_rate; i++, statuses++) {
+                send_status(_badges[statuses % _badges.size()], false);
+                busy = true;
+            }
+
+            for (size_t i = 0; i < BATCH_SIZE && scans < elapsed * scan_rate; i++, scans++) {
+                send_scan(_badges[scans % _badges.size()]);
+                busy = true;
+            }
+
+            // Only badges without an answer still to come are probed, so every reply has one probe
+            for (size_t tries = 0; probes < elapsed * probe_rate && tries < _badges.size(); tries++) {
+                VirtualBadge &badge = _badges[next_probe++ % _badges.size()];
+                if (!badge.probing) {
+                    send_probe(badge);
+                    probes++;
+                    busy = true;
+                }
+            }
+
+            flush();
+            busy |= receive() > 0;
+            flush();
+
+            if (now - last_expiry > std::chrono::milliseconds(PROBE_TIMEOUT_MS / 10)) {
+                expire_probes(now);
+                last_expiry = now;
+            }
+
+            if (!busy) {
+                struct pollfd pfd{_sockfd, POLLIN, 0};
+                poll(&pfd, 1, 1);
+            }
+        }
+
+        // Give the last probes their chance to come back
+        auto drain_end = Clock::now() + std::chrono::milliseconds(PROBE_TIMEOUT_MS);
+        for (auto now = Clock::now(); now < drain_end; now = Clock::now()) {
+            receive();
+            flush();
+
+            struct pollfd pfd{_sockfd, POLLIN, 0};
+            poll(&pfd, 1, 10);
+        }
+
+        expire_probes(Clock::time_point::max());
+    }
+};
+
+static void usage(const char *name) {
+    std::cerr << "Usage: " << name << " [--host IP] [--port N] [--badges N] [--threads N] [--duration S] [--status-rate HZ] [--scan-interval S] [--stations N] [--probe-rate HZ] [--press-chance P] [--join-chance P] [--join SEQ]" << std::endl;
+}
+
+static uint32_t percentile(const std::vector<uint32_t> &sorted, double p) {
+    return sorted.empty() ? 0 : sorted[(size_t)(p * (sorted.size() - 1))];
+}
+
+int main(int argc, char **argv) {
+    SwarmOptions options{};
+    options.router.sin_family = AF_INET;
+    options.router.sin_port = htons(PORT);
+    options.router.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    options.badges = 1000;
+    options.threads = 1;
+    options.duration = 10;
+    options.status_rate = 10;
+    options.scan_interval = 5;
+    options.stations = 20;
+    options.probe_rate = 100;
+    options.press_chance = 0.05;
+    options.join_chance = 0.001;
+    options.join = "uuddlrlrba";
+
+    static const struct option long_options[] = {
+            {"host",          required_argument, nullptr, 'H'},
+            {"port",          required_argument, nullptr, 'p'},
+            {"badges",        required_argument, nullptr, 'n'},
+            {"threads",       required_argument, nullptr, 'j'},
+            {"duration",      required_argument, nullptr, 'd'},
+            {"status-rate",   required_argument, nullptr, 's'},
+            {"scan-interval", required_argument, nullptr, 'S'},
+            {"stations",      required_argument, nullptr, 'a'},
+            {"probe-rate",    required_argument, nullptr, 'P'},
+            {"press-chance",  required_argument, nullptr, 'b'},
+            {"join-chance",   required_argument, nullptr, 'J'},
+            {"join",          required_argument, nullptr, 'q'},
+            {"help",          no_argument,       nullptr, 'h'},
+            {nullptr,         0,                 nullptr, 0},
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "H:p:n:j:d:s:S:a:P:b:J:q:h", long_options, nullptr)) != -1) {
+        switch (opt) {
+            case 'H':
+                if (inet_pton(AF_INET, optarg, &options.router.sin_addr) != 1) {
+                    usage(argv[0]);
+                    return 1;
+                }
+                break;
+
+            case 'p':
+                options.router.sin_port = htons((uint16_t)strtoul(optarg, nullptr, 10));
+                break;
+
+            case 'n':
+                options.badges = strtoul(optarg, nullptr, 10);
+                break;
+
+            case 'j':
+                options.threads = std::max(1ul, strtoul(optarg, nullptr, 10));
+                break;
+
+            case 'd':
+                options.duration = (unsigned)strtoul(optarg, nullptr, 10);
+                break;
+
+            case 's':
+                options.status_rate = strtod(optarg, nullptr);
+                break;
+
+            case 'S':
+                options.scan_interval = strtod(optarg, nullptr);
+                break;
+
+            case 'a':
+                options.stations = strtoul(optarg, nullptr, 10);
+                break;
+
+            case 'P':
+                options.probe_rate = strtod(optarg, nullptr);
+                break;
+
+            case 'b':
+                options.press_chance = strtod(optarg, nullptr);
+                break;
+
+            case 'J':
+                options.join_chance = strtod(optarg, nullptr);
+                break;
+
+            case 'q':
+                options.join = optarg;
+                if (std::any_of(options.join.begin(), options.join.end(), [](char c) {
+                    return button_from_char(c) == BUTTON::NONE;
+                })) {
+                    std::cerr << "Join sequences are made of r, d, l, u, e, s, b and a" << std::endl;
+                    return 1;
+                }
+                break;
+
+            case 'h':
+                usage(argv[0]);
+                return 0;
+
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+
+    SwarmCounters counters{};
+
+    std::vector<std::unique_ptr<Swarm>> swarms;
+    std::vector<std::thread> threads;
+    for (unsigned i = 0; i < options.threads; i++) {
+        swarms.emplace_back(new Swarm(options, counters, i));
+    }
+
+    auto start = Clock::now();
+    for (auto &swarm : swarms) {
+        threads.emplace_back(&Swarm::run, swarm.get());
+    }
+
+    uint64_t last_sent = 0;
+    uint64_t last_received = 0;
+    for (unsigned second = 1; second <= options.duration; second++) {
+        std::this_thread::sleep_until(start + std::chrono::milliseconds(REPORT_INTERVAL_MS * second));
+
+        uint64_t sent = counters.sent;
+        uint64_t received = counters.received;
+        std::cout << second << "s: sent " << sent - last_sent << " packets/s, received "
+                  << received - last_received << " packets/s" << std::endl;
+
+        last_sent = sent;
+        last_received = received;
+    }
+
+    for (auto &thread : threads) {
+        thread.join();
+    }
+
+    std::vector<uint32_t> rtt_us;
+    for (const auto &swarm : swarms) {
+        rtt_us.insert(rtt_us.end(), swarm->rtt_us().begin(), swarm->rtt_us().end());
+    }
+    std::sort(rtt_us.begin(), rtt_us.end());
+
+    double target = options.badges * (options.status_rate
+                                      + (options.scan_interval > 0
+                                         ? ((options.stations + STATIONS_PER_FRAGMENT - 1) / STATIONS_PER_FRAGMENT)
+                                           / options.scan_interval
+                                         : 0))
+                    + options.probe_rate;
+
+    std::cout << "Badges:        " << options.badges << " on " << options.threads << " threads" << std::endl;
+    std::cout << "Sent:          " << counters.sent << " packets, "
+              << (uint64_t)(counters.sent / (double)options.duration) << " packets/s sustained, replies included ("
+              << (uint64_t)target << " asked for before replies)" << std::endl;
+    std::cout << "Received:      " << counters.received << " packets" << std::endl;
+    std::cout << "Send drops:    " << counters.send_errors << std::endl;
+    std::cout << "Probes:        " << counters.probes << ", " << counters.probes_lost << " unanswered" << std::endl;
+    std::cout << "Round trip us: p50 " << percentile(rtt_us, 0.5) << ", p90 " << percentile(rtt_us, 0.9)
+              << ", p99 " << percentile(rtt_us, 0.99) << ", p99.9 " << percentile(rtt_us, 0.999)
+              << ", max " << (rtt_us.empty() ? 0 : rtt_us.back()) << std::endl;
+
+    return 0;
+}
@@ -0,0 +1,102 @@
+/*
+ * Measures what it costs to route one WAMP event to its handler: the topic split and verb lookup for
+ * badge.<id>.<verb>, and the game id split for game.<id>.lights. The regex and stoull the router used
+ * before are timed on the same topics alongside, for comparison.
+ */
+
+#include <stdlib.h>
+#include <chrono>
+#include <iostream>
+#include <regex>
+#include <string>
+#include <vector>
+
+#include "topics.h"
+
+#define TOPICS 1024
+#define ROUNDS 2000
+// The regex is slow enough that fewer rounds give as steady a number
+#define REGEX_ROUNDS 50
+
+using Clock = std::chrono::steady_clock;
+
+// Keeps the compiler from dropping results nothing reads
+static volatile uint64_t sink;
+
+template<typename F>
+static double ns_per_topic(const std::vector<std::string> &topics, int rounds, F f) {
+    auto start = Clock::now();
+    for (int round = 0; round < rounds; round++) {
+        for (const std::string &topic : topics) {
+            f(topic);
+        }
+    }
+    auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count();
+
+    return (double)elapsed / ((double)rounds * topics.size());
+}
+
+int main() {
+    static const char *VERBS[] = {"lights_static", "request_scan", "text", "clear_text", "screen"};
+
+    std::vector<std::string> badge_topics;
+    std::vector<std::string> game_topics;
+    for (int i = 0; i < TOPICS; i++) {
+        uint64_t badge_id = 0x5CCF7F000000ull + (uint64_t)i * 7919;
+        badge_topics.push_back("badge." + std::to_string(badge_id) + "." + VERBS[i % 5]);
+        game_topics.push_back("game.game" + std::to_string(i % 32) + ".lights");
+    }
+
+    uint64_t failed = 0;
+
+    double badge_ns = ns_per_topic(badge_topics, ROUNDS, [&](const std::string &topic) {
+        uint64_t badge_id;
+        BadgeVerb verb;
+        if (parse_badge_topic(topic, badge_id, verb) && verb != BadgeVerb::UNKNOWN) {
+            sink = badge_id + (uint64_t)verb;
+        } else {
+            failed++;
+        }
+    });
+
+    static const std::regex badge_id_regex("badge\\.([0-9]+)\\..*");
+    double badge_regex_ns = ns_per_topic(badge_topics, REGEX_ROUNDS, [&](const std::string &topic) {
+        std::smatch res;
+        if (std::regex_match(topic, res, badge_id_regex)) {
+            sink = std::stoull(res[1]);
+        } else {
+            failed++;
+        }
+    });
+
+    double game_ns = ns_per_topic(game_topics, ROUNDS, [&](const std::string &topic) {
+        std::string game_id;
+        if (parse_game_topic(topic, game_id)) {
+            sink = game_id.size();
+        } else {
+            failed++;
+        }
+    });
+
+    static const std::regex game_id_regex("game\\.([^.]+)\\..*");
+    double game_regex_ns = ns_per_topic(game_topics, REGEX_ROUNDS, [&](const std::string &topic) {
+        std::smatch res;
+        if (std::regex_match(topic, res, game_id_regex)) {
+            sink = res[1].length();
+        } else {
+            failed++;
+        }
+    });
+
+    std::cout << "badge.<id>.<verb>: " << badge_ns << " ns per event, regex " << badge_regex_ns << " ns"
+              << std::endl;
+    std::cout << "game.<id>.lights: " << game_ns << " ns per event, regex " << game_regex_ns << " ns"
+              << std::endl;
+
+    if (failed != 0) {
+        std::cout << failed << " topics didn't parse" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}